@@ -19,25 +19,54 @@
  *   -> http://tinyapps.sourceforge.net/
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 
 
 /******************** Main ***************************************************/
+static void parse_options(int *argc, char **argv);
 static void not_tty(char **argv);
 static int  run_diff(char **argv);
 static void loop(void);
+static bool tree_mode(char **argv);
+static int  run_tree(void);
+static bool builtin_mode(char **argv);
+static int  diff_files(const char *a, const char *b, bool color);
+
+static bool words;
+static unsigned jobs;
 
 int main(int argc, char **argv) {
+	parse_options(&argc, argv);
+
 	/* If not TTY either run diff or pass in->out through (cat) */
 	if (!isatty(1)) {
 		not_tty(argv);
 		return 1;
 	}
 
+	/* Unified diff of two files is done here */
+	if (builtin_mode(argv)) {
+		return diff_files(argv[argc - 2], argv[argc - 1], true);
+	}
+
 	/* If arguments given run diff and prepare pipe */
 	if (argc > 1) {
 		int ret = run_diff(argv);
@@ -53,8 +82,33 @@ int main(int argc, char **argv) {
 
 
 
+/******************** Parse our own options **********************************/
+/* Our options come before diff's and are not passed to it. */
+static void parse_options(int *argc, char **argv) {
+	while (argv[1]) {
+		if (!strcmp(argv[1], "--words")) {
+			words = true;
+		} else if (!strncmp(argv[1], "--jobs=", 7)) {
+			jobs = strtoul(argv[1] + 7, NULL, 10);
+		} else {
+			break;
+		}
+		memmove(argv + 1, argv + 2, (*argc)-- * sizeof *argv - sizeof *argv);
+	}
+}
+
+
+
 /******************** Handle no TTY case *************************************/
 static void not_tty(char **argv) {
+	size_t n;
+
+	if (builtin_mode(argv)) {
+		for (n = 1; argv[n]; ++n);
+		exit(diff_files(argv[n - 2], argv[n - 1], false));
+	} else if (tree_mode(argv)) {
+		exit(run_tree());
+	}
 	argv[0] = (char *)(argv[1] ? "diff" : "cat");
 	execvp(argv[0], argv);
 	perror(argv[1] ? "exec: diff" : "exec: cat");
@@ -82,6 +136,9 @@ static int run_diff(char **argv) {
 			perror("dup2");
 			return 1;
 		}
+		if (tree_mode(argv)) {
+			exit(run_tree());
+		}
 		argv[0] = (char *)"diff";
 		execvp("diff", argv);
 		perror("exec: diff");
@@ -100,146 +157,1690 @@ static int run_diff(char **argv) {
 
 
 
+/******************** Output buffer ******************************************/
+static char   out_buf[1 << 18];
+static size_t out_len;
+
+static void write_all(const char *data, size_t len);
+
+
+/* Output is gathered and written once per input block. */
+static void out_flush(void) {
+	write_all(out_buf, out_len);
+	out_len = 0;
+}
+
+
+/* Large chunks are written directly rather than copied. */
+static void out_put(const char *data, size_t len) {
+	if (len > sizeof out_buf - out_len || len >= sizeof out_buf / 4) {
+		out_flush();
+		if (len >= sizeof out_buf / 4) {
+			write_all(data, len);
+			return;
+		}
+	}
+	memcpy(out_buf + out_len, data, len);
+	out_len += len;
+}
+
+
+static void write_all(const char *data, size_t len) {
+	ssize_t ret;
+
+	while (len) {
+		ret = write(1, data, len);
+		if (ret > 0) {
+			data += ret;
+			len  -= ret;
+		} else if (errno != EINTR) {
+			perror("write");
+			exit(1);
+		}
+	}
+}
+
+
+
+/******************** Memory *************************************************/
+struct buffer {
+	char *data;
+	size_t len, capacity;
+};
+
+
+static void *xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		fputs("out of memory\n", stderr);
+		exit(1);
+	}
+	return ptr;
+}
+
+
+/* Makes sure array has room for need elements of given size. */
+static void *grow(void *array, size_t *capacity, size_t need, size_t size) {
+	if (need > *capacity) {
+		*capacity = need < 64 ? 64 : need * 2;
+		array = xrealloc(array, *capacity * size);
+	}
+	return array;
+}
+
+
+static void buffer_put(struct buffer *buf, const char *data, size_t len) {
+	buf->data = grow(buf->data, &buf->capacity, buf->len + len, 1);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+
+
+/******************** Compare directory trees ********************************/
+/* With -r and two directories as the last arguments trees are walked
+ * here and files are compared by a pool of diff processes.  Their
+ * output is passed on in the order diff -r would produce it, streaming
+ * the first unfinished one and buffering the rest. */
+struct task {
+	char *path;         /* relative to both roots; NULL if out is all */
+	struct buffer out;  /* diff's output or a message */
+	bool header;        /* whether diff -r header was dealt with */
+	pid_t pid;
+	int fd;             /* diff's stdout; -1 when done */
+};
+
+static struct {
+	char **argv;        /* diff's arguments with room for operands */
+	const char *root[2];
+	const char *label[2];  /* names to use in headers instead of paths */
+	size_t opts;        /* number of options in argv */
+	bool brief;
+	bool builtin;       /* whether files are compared by diff_files() */
+	int status;         /* as diff's: 1 if trees differ, 2 on trouble */
+	struct task *tasks;
+	size_t count, capacity;
+} tree;
+
+static void walk(const char *rel);
+static bool unified_options(char **argv, size_t n, bool recursive);
+
+
+static void add_label(const char *label) {
+	if (!tree.label[0]) {
+		tree.label[0] = label;
+	} else if (!tree.label[1]) {
+		tree.label[1] = label;
+	}
+}
+
+
+/* Tells whether name, possibly abbreviated, is the long option full. */
+static bool long_is(const char *name, size_t len, const char *full) {
+	return len >= 3 && len <= strlen(full) && !strncmp(name, full, len);
+}
+
+
+/* Checks whether diff is asked to compare directories recursively with
+ * options we can pass to diff for each file.  Anything else, e.g. an
+ * option whose argument is a separate word, is left to diff. */
+static bool tree_mode(char **argv) {
+	static const char *const unsupported[] = {
+		"new-file", "unidirectional-new-file", "exclude",
+		"exclude-from", "starting-file", "from-file", "to-file",
+		"no-dereference", NULL
+	};
+	const char *const *u, *arg, *ch;
+	bool recursive = false;
+	struct stat st;
+	size_t n, i, len;
+
+	for (n = 1; argv[n]; ++n);
+	if (n < 4) {
+		return false;
+	}
+
+	for (i = 1; i < n - 2; ++i) {
+		arg = argv[i];
+		if (arg[0] != '-' || !arg[1] || !strcmp(arg, "--")) {
+			return false;
+		} else if (arg[1] == '-') {
+			len = strcspn(arg + 2, "=");
+			recursive |= long_is(arg + 2, len, "recursive");
+			tree.brief |= long_is(arg + 2, len, "brief");
+			if (long_is(arg + 2, len, "label") && arg[2 + len]) {
+				add_label(arg + 3 + len);
+			}
+			for (u = unsupported; *u && !long_is(arg + 2, len, *u); ++u);
+			if (*u) {
+				return false;
+			}
+			continue;
+		}
+
+		for (ch = arg + 1; *ch; ++ch) {
+			if (*ch == 'r') {
+				recursive = true;
+			} else if (*ch == 'q') {
+				tree.brief = true;
+			} else if (strchr("NPSxX", *ch)) {
+				return false;
+			} else if (strchr("CDFILUW", *ch)) {
+				if (!ch[1]) {
+					return false;
+				} else if (*ch == 'L') {
+					add_label(ch + 1);
+				}
+				break;
+			}
+		}
+	}
+
+	tree.root[0] = argv[n - 2];
+	tree.root[1] = argv[n - 1];
+	if (!recursive ||
+	    stat(tree.root[0], &st) || !S_ISDIR(st.st_mode) ||
+	    stat(tree.root[1], &st) || !S_ISDIR(st.st_mode)) {
+		return false;
+	}
+
+	/* "diff" <options> "--" <file1> <file2> NULL */
+	tree.builtin = unified_options(argv + 1, n - 3, true);
+	tree.opts = n - 3;
+	tree.argv = xrealloc(NULL, (n + 2) * sizeof *tree.argv);
+	tree.argv[0] = (char *)"diff";
+	memcpy(tree.argv + 1, argv + 1, tree.opts * sizeof *argv);
+	tree.argv[n - 2] = (char *)"--";
+	tree.argv[n + 1] = NULL;
+	return true;
+}
+
+
+static char *join(const char *dir, const char *name) {
+	size_t len = strlen(dir);
+	char *path;
+
+	if (!len || !*name) {
+		return strcpy(xrealloc(NULL, len + strlen(name) + 1),
+		              len ? dir : name);
+	}
+	path = xrealloc(NULL, len + strlen(name) + 2);
+	sprintf(path, dir[len - 1] == '/' ? "%s%s" : "%s/%s", dir, name);
+	return path;
+}
+
+
+static struct task *add_task(char *path) {
+	struct task *task;
+
+	tree.tasks = grow(tree.tasks, &tree.capacity, tree.count + 1,
+	                  sizeof *tree.tasks);
+	task = tree.tasks + tree.count++;
+	memset(task, 0, sizeof *task);
+	task->path = path;
+	task->fd = -1;
+	return task;
+}
+
+
+static void add_message(const char *fmt, const char *a, const char *b,
+                        const char *c, const char *d) {
+	struct buffer *const buf = &add_task(NULL)->out;
+	int len = snprintf(NULL, 0, fmt, a, b, c, d);
+
+	buf->data = xrealloc(NULL, len + 1);
+	buf->len = buf->capacity = len;
+	sprintf(buf->data, fmt, a, b, c, d);
+	tree.status |= 1;
+}
+
+
+static const char *file_type(const struct stat *st) {
+	return S_ISREG(st->st_mode) ? (st->st_size ? "regular file"
+	                                          : "regular empty file")
+		: S_ISDIR(st->st_mode)  ? "directory"
+		: S_ISLNK(st->st_mode)  ? "symbolic link"
+		: S_ISFIFO(st->st_mode) ? "fifo"
+		: S_ISSOCK(st->st_mode) ? "socket"
+		: S_ISCHR(st->st_mode)  ? "character special file"
+		: S_ISBLK(st->st_mode)  ? "block special file"
+		: "weird file";
+}
+
+
+/* Compares entry present in both trees. */
+static void compare_entry(char *rel) {
+	char *a = join(tree.root[0], rel), *b = join(tree.root[1], rel);
+	struct stat sa, sb;
+
+	if (stat(a, &sa) || stat(b, &sb) ||
+	    (S_ISREG(sa.st_mode) && S_ISREG(sb.st_mode))) {
+		/* Let diff report errors */
+		add_task(rel);
+	} else if (S_ISDIR(sa.st_mode) && S_ISDIR(sb.st_mode)) {
+		walk(rel);
+		free(rel);
+	} else {
+		add_message("File %s is a %s while file %s is a %s\n",
+		            a, file_type(&sa), b, file_type(&sb));
+		free(rel);
+	}
+	free(a);
+	free(b);
+}
+
+
+static int not_dots(const struct dirent *ent) {
+	return strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..");
+}
+
+
+/* Adds tasks for a directory in the order diff -r would visit it. */
+static void walk(const char *rel) {
+	struct dirent **list[2] = { NULL, NULL };
+	char *dir[2];
+	int n[2], i[2] = { 0, 0 }, side, cmp;
+
+	for (side = 0; side < 2; ++side) {
+		dir[side] = join(tree.root[side], rel);
+		n[side] = scandir(dir[side], list + side, not_dots, alphasort);
+		if (n[side] < 0) {
+			fprintf(stderr, "diff: %s: %s\n", dir[side], strerror(errno));
+			n[side] = 0;
+		}
+	}
+
+	while (i[0] < n[0] || i[1] < n[1]) {
+		cmp = i[0] == n[0] ? 1 : i[1] == n[1] ? -1
+			: strcoll(list[0][i[0]]->d_name, list[1][i[1]]->d_name);
+		if (cmp) {
+			side = cmp > 0;
+			add_message("Only in %s: %s\n", dir[side],
+			            list[side][i[side]]->d_name, NULL, NULL);
+			++i[side];
+		} else {
+			compare_entry(join(rel, list[0][i[0]]->d_name));
+			++i[0];
+			++i[1];
+		}
+	}
+
+	for (side = 0; side < 2; ++side) {
+		while (n[side]--) {
+			free(list[side][n[side]]);
+		}
+		free(list[side]);
+		free(dir[side]);
+	}
+}
+
+
+static bool start_task(struct task *task) {
+	char **const operands = tree.argv + tree.opts + 2;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		return false;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+	operands[0] = join(tree.root[0], task->path);
+	operands[1] = join(tree.root[1], task->path);
+	pid = fork();
+	if (!pid) {
+		if (dup2(fds[1], 1) < 0) {
+			perror("dup2");
+			_exit(2);
+		}
+		close(fds[1]);
+		if (tree.builtin) {
+			_exit(diff_files(operands[0], operands[1], false));
+		}
+		execvp("diff", tree.argv);
+		perror("exec: diff");
+		_exit(2);
+	}
+	free(operands[0]);
+	free(operands[1]);
+	close(fds[1]);
+
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		return false;
+	}
+	task->pid = pid;
+	task->fd = fds[0];
+	return true;
+}
+
+
+/* Quotes an option for the shell the way diff does in headers. */
+static void put_option(struct buffer *buf, const char *arg) {
+	const char *ch;
+	bool quote = false, single = false, plain = true;
+
+	for (ch = arg; *ch; ++ch) {
+		quote |= strchr("\a\b\t\n\v\f\r !\"$&'()*;<=>?[\\^`|", *ch) ||
+			(ch == arg && (*ch == '#' || *ch == '~'));
+		single |= *ch == '\'';
+		/* With nothing else special double quotes do */
+		plain &= isalnum((unsigned char)*ch) ||
+			strchr(" '%+,-./:@]_", *ch);
+	}
+
+	if (!quote && *arg) {
+		buffer_put(buf, arg, strlen(arg));
+	} else if (single && plain) {
+		buffer_put(buf, "\"", 1);
+		buffer_put(buf, arg, strlen(arg));
+		buffer_put(buf, "\"", 1);
+	} else {
+		buffer_put(buf, "'", 1);
+		for (ch = arg; *ch; ++ch) {
+			if (*ch == '\'') {
+				buffer_put(buf, "'\\''", 4);
+			} else {
+				buffer_put(buf, ch, 1);
+			}
+		}
+		buffer_put(buf, "'", 1);
+	}
+}
+
+
+/* Puts file name in C-style quotes if it has spaces or special
+ * characters, like diff does in headers. */
+static void put_name(struct buffer *buf, const char *name) {
+	static const char special[] = "\a\b\t\n\v\f\r\"\\";
+	static const char escapes[] = "abtnvfr\"\\";
+	const unsigned char *ch;
+	const char *p;
+	char octal[5];
+
+	for (ch = (const unsigned char *)name;
+	     *ch && *ch != ' ' && *ch >= 32 && *ch < 128 &&
+	     !strchr(special, *ch);
+	     ++ch);
+	if (!*ch) {
+		buffer_put(buf, name, strlen(name));
+		return;
+	}
+
+	buffer_put(buf, "\"", 1);
+	for (ch = (const unsigned char *)name; *ch; ++ch) {
+		if ((p = strchr(special, *ch))) {
+			buffer_put(buf, "\\", 1);
+			buffer_put(buf, escapes + (p - special), 1);
+		} else if (*ch < 32 || *ch >= 128) {
+			sprintf(octal, "\\%03o", *ch);
+			buffer_put(buf, octal, 4);
+		} else {
+			buffer_put(buf, (const char *)ch, 1);
+		}
+	}
+	buffer_put(buf, "\"", 1);
+}
+
+
+/* Tells whether buf starts with, or may yet turn out to start with
+ * (unless eof), one of diff's messages, which come without a header.
+ * Returns -1 if that's not known yet. */
+static int is_message(const struct buffer *buf, const char *a, const char *b,
+                      bool eof) {
+	static const char *const formats[] = {
+		"Binary files %s and %s differ\n",
+		"Files %s and %s are identical\n",
+	};
+	char *msg;
+	size_t i, len;
+	int ret = 0;
+
+	for (i = 0; !ret && i < sizeof formats / sizeof *formats; ++i) {
+		len = snprintf(NULL, 0, formats[i], a, b);
+		msg = xrealloc(NULL, len + 1);
+		sprintf(msg, formats[i], a, b);
+		if (buf->len >= len) {
+			ret = !memcmp(buf->data, msg, len);
+		} else if (!eof && !memcmp(buf->data, msg, buf->len)) {
+			ret = -1;
+		}
+		free(msg);
+	}
+	return ret;
+}
+
+
+/* Adds the header diff -r would before diff's output, unless that is
+ * only a message.  Sets task->header once that is decided. */
+static void add_header(struct task *task, bool eof) {
+	struct buffer *const buf = &task->out;
+	struct buffer header = { NULL, 0, 0 };
+	char *const a = join(tree.root[0], task->path);
+	char *const b = join(tree.root[1], task->path);
+	const char *const name[2] = {
+		tree.label[0] ? tree.label[0] : a,
+		tree.label[1] ? tree.label[1] : b
+	};
+	size_t i;
+	int msg = tree.brief || !buf->len ? 1
+		: is_message(buf, name[0], name[1], eof);
+
+	if (msg < 0 && !eof) {
+		free(a);
+		free(b);
+		return;
+	}
+
+	task->header = true;
+	if (!msg) {
+		buffer_put(&header, "diff", 4);
+		for (i = 1; i <= tree.opts; ++i) {
+			buffer_put(&header, " ", 1);
+			put_option(&header, tree.argv[i]);
+		}
+		buffer_put(&header, " ", 1);
+		put_name(&header, name[0]);
+		buffer_put(&header, " ", 1);
+		put_name(&header, name[1]);
+		buffer_put(&header, "\n", 1);
+		/* Header goes before data which is already in the buffer */
+		buffer_put(&header, buf->data, buf->len);
+		free(buf->data);
+		*buf = header;
+	}
+	free(a);
+	free(b);
+}
+
+
+/* Reads diff's output; at its start adds the header diff -r would. */
+static void read_task(struct task *task) {
+	struct buffer *const buf = &task->out;
+	ssize_t ret;
+	int status;
+
+	buf->data = grow(buf->data, &buf->capacity, buf->len + 65536, 1);
+	ret = read(task->fd, buf->data + buf->len, buf->capacity - buf->len);
+	if (ret < 0 && errno == EINTR) {
+		return;
+	} else if (ret > 0) {
+		buf->len += ret;
+		if (!task->header) {
+			add_header(task, false);
+		}
+	} else {
+		close(task->fd);
+		task->fd = -1;
+		if (!task->header) {
+			add_header(task, true);
+		}
+		while (waitpid(task->pid, &status, 0) < 0 && errno == EINTR);
+		status = WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+		tree.status |= status > 1 ? 2 : status;
+	}
+}
+
+
+static int run_tree(void) {
+	struct pollfd *pfds;
+	struct task *task;
+	size_t head = 0, next = 0, n, i;
+	unsigned running = 0;
+
+	if (!jobs) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus > 0 ? cpus : 1;
+	}
+	pfds = xrealloc(NULL, jobs * sizeof *pfds);
+
+	walk("");
+
+	while (head < tree.count) {
+		for (; running < jobs && next < tree.count; ++next) {
+			task = tree.tasks + next;
+			if (task->path && !start_task(task)) {
+				tree.status |= 2;
+			} else {
+				running += task->path != NULL;
+			}
+		}
+
+		/* Pass on what we have, in order */
+		for (; head < next; ++head) {
+			task = tree.tasks + head;
+			if (!task->path || task->header) {
+				write_all(task->out.data, task->out.len);
+				task->out.len = 0;
+			}
+			if (task->fd >= 0) {
+				break;
+			}
+			free(task->out.data);
+			free(task->path);
+		}
+
+		for (n = 0, i = head; i < next; ++i) {
+			if (tree.tasks[i].fd >= 0) {
+				pfds[n].fd = tree.tasks[i].fd;
+				pfds[n].events = POLLIN;
+				++n;
+			}
+		}
+		if (!n) {
+			continue;
+		}
+		if (poll(pfds, n, -1) < 0) {
+			if (errno != EINTR) {
+				perror("poll");
+				return 2;
+			}
+			continue;
+		}
+
+		for (n = 0, i = head; i < next; ++i) {
+			task = tree.tasks + i;
+			if (task->fd >= 0 && pfds[n++].revents) {
+				read_task(task);
+				running -= task->fd < 0;
+			}
+		}
+	}
+
+	free(pfds);
+	return tree.status > 1 ? 2 : tree.status;
+}
+
+
+
+/******************** Diff engine ********************************************/
+/* Myers' O(ND) difference algorithm in linear space: find the middle
+ * snake of the shortest edit script and recurse on both halves.
+ * Tokens are compared by hash first. */
+struct token {
+	const char *str;
+	size_t len;
+	unsigned long hash;
+};
+
+struct diff {
+	const struct token *a, *b;
+	bool *ca, *cb;
+	long *fd, *bd;  /* furthest reaching x on each diagonal x - y */
+	long limit;     /* edit cost past which a worse split is taken */
+};
+
+static void compare_seq(struct diff *d, long xoff, long xlim,
+                        long yoff, long ylim);
+
+
+/* Marks tokens of a and b which are not part of their longest common
+ * subsequence in ca and cb.  If halves of a region differ by more than
+ * limit edits, the furthest reaching path found so far is used instead
+ * of the middle snake, so result may be less than minimal. */
+static void diff_tokens(const struct token *a, long n,
+                        const struct token *b, long m,
+                        bool *ca, bool *cb, long limit) {
+	static long *diags;
+	static size_t capacity;
+	struct diff d;
+	long i;
+
+	diags = grow(diags, &capacity, 2 * (n + m + 3), sizeof *diags);
+	d.a = a;
+	d.b = b;
+	d.ca = ca;
+	d.cb = cb;
+	d.fd = diags + m + 1;
+	d.bd = diags + (n + m + 3) + m + 1;
+	d.limit = limit;
+
+	for (i = 0; i < n; ++i) ca[i] = false;
+	for (i = 0; i < m; ++i) cb[i] = false;
+	compare_seq(&d, 0, n, 0, m);
+}
+
+
+/* Hashes eight bytes at a time; lines get hashed once so equal hashes
+ * make comparing them cheap. */
+static unsigned long hash_bytes(const char *str, size_t len) {
+	uint64_t hash = len * 0x9e3779b97f4a7c15ull, word;
+
+	for (; len >= 8; str += 8, len -= 8) {
+		memcpy(&word, str, 8);
+		hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+		hash ^= hash >> 32;
+	}
+	word = 0;
+	memcpy(&word, str, len);
+	hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ull;
+	return hash ^ hash >> 29;
+}
+
+
+/* Lines numbered by diff_lines() have no text, only their class in hash;
+ * don't call memcmp() for them. */
+static bool token_eq(const struct token *a, const struct token *b) {
+	return a->hash == b->hash && a->len == b->len &&
+		(!a->len || !memcmp(a->str, b->str, a->len));
+}
+
+
+/* Finds a point on the middle snake of a region whose ends differ. */
+static bool find_split(struct diff *d, long xoff, long xlim,
+                       long yoff, long ylim, long *xs, long *ys) {
+	const long dmin = xoff - ylim, dmax = xlim - yoff;
+	const long fmid = xoff - yoff, bmid = xlim - ylim;
+	const bool odd = (fmid - bmid) & 1;
+	long fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+	long *const fd = d->fd, *const bd = d->bd;
+	long c, k, x, y;
+
+	fd[fmid] = xoff;
+	bd[bmid] = xlim;
+
+	for (c = 1; c <= d->limit; ++c) {
+		/* Extend forward paths by one edit */
+		if (fmin > dmin) fd[--fmin - 1] = -1; else ++fmin;
+		if (fmax < dmax) fd[++fmax + 1] = -1; else --fmax;
+		for (k = fmax; k >= fmin; k -= 2) {
+			x = fd[k - 1] >= fd[k + 1] ? fd[k - 1] + 1 : fd[k + 1];
+			y = x - k;
+			while (x < xlim && y < ylim &&
+			       token_eq(d->a + x, d->b + y)) {
+				++x;
+				++y;
+			}
+			fd[k] = x;
+			if (odd && bmin <= k && k <= bmax && bd[k] <= x) {
+				*xs = x;
+				*ys = y;
+				return true;
+			}
+		}
+
+		/* And backward ones */
+		if (bmin > dmin) bd[--bmin - 1] = LONG_MAX; else ++bmin;
+		if (bmax < dmax) bd[++bmax + 1] = LONG_MAX; else --bmax;
+		for (k = bmax; k >= bmin; k -= 2) {
+			x = bd[k - 1] < bd[k + 1] ? bd[k - 1] : bd[k + 1] - 1;
+			y = x - k;
+			while (x > xoff && y > yoff &&
+			       token_eq(d->a + x - 1, d->b + y - 1)) {
+				--x;
+				--y;
+			}
+			bd[k] = x;
+			if (!odd && fmin <= k && k <= fmax && x <= fd[k]) {
+				*xs = x;
+				*ys = y;
+				return true;
+			}
+		}
+	}
+
+	/* Too expensive, settle for a forward path which got furthest */
+	*xs = *ys = -1;
+	for (k = fmax; k >= fmin; k -= 2) {
+		x = fd[k];
+		y = x - k;
+		if (x <= xlim && yoff <= y && y <= ylim &&
+		    x + y < xlim + ylim && x + y > *xs + *ys) {
+			*xs = x;
+			*ys = y;
+		}
+	}
+	return *xs + *ys > xoff + yoff;
+}
+
+
+static void compare_seq(struct diff *d, long xoff, long xlim,
+                        long yoff, long ylim) {
+	long xs, ys;
+
+	/* Strip common prefix and suffix */
+	while (xoff < xlim && yoff < ylim &&
+	       token_eq(d->a + xoff, d->b + yoff)) {
+		++xoff;
+		++yoff;
+	}
+	while (xoff < xlim && yoff < ylim &&
+	       token_eq(d->a + xlim - 1, d->b + ylim - 1)) {
+		--xlim;
+		--ylim;
+	}
+
+	if (xoff == xlim || yoff == ylim ||
+	    !find_split(d, xoff, xlim, yoff, ylim, &xs, &ys)) {
+		for (; xoff < xlim; ++xoff) d->ca[xoff] = true;
+		for (; yoff < ylim; ++yoff) d->cb[yoff] = true;
+	} else {
+		compare_seq(d, xoff, xs, yoff, ys);
+		compare_seq(d, xs, xlim, ys, ylim);
+	}
+}
+
+
+
 /******************** Main loop; main part of the app ************************/
 struct pattern {
 	const char pattern[7];
 	unsigned char idx;
 };
 
-static unsigned find(const struct pattern *patterns, const char *str);
+static unsigned find(const struct pattern *patterns,
+                     const char *str, const char *end);
+static bool match_char(char pat, char ch);
+
+
+enum color_number {
+	COLOR_DEFAULT, /* must be zero */
+	COLOR_INS,
+	COLOR_DEL,
+	COLOR_CHANGE,
+	COLOR_EQUAL,
+	COLOR_FILE1,
+	COLOR_FILE2,
+	COLOR_POS1,
+	COLOR_POS2,
+	COLOR_MISC,
+	COLOR_COUNT
+};
 
 
+static const char colors[COLOR_COUNT][8] = {
+	[COLOR_DEFAULT] = "0;37",
+	[COLOR_INS]     = "1;32",
+	[COLOR_DEL]     = "1;31",
+	[COLOR_CHANGE]  = "1;33",
+	[COLOR_EQUAL]   = "0;37",
+	[COLOR_FILE1]   = "0;32",
+	[COLOR_FILE2]   = "0;31",
+	[COLOR_POS1]    = "0;32",
+	[COLOR_POS2]    = "0;31",
+	[COLOR_MISC]    = "0;35",
+};
+
+
+static const struct pattern modes[] = {
+	{ "-", 1 },
+	{ "*", 2 },
+	{ "0", 3 },
+	{ "",  0 } /* side note: 0 == COLOR_DEFAULT */
+};
+
+static const struct pattern unified_ruleset[] = {
+	{ "+++ " , COLOR_FILE1   },
+	{ "--- " , COLOR_FILE2   },
+	{ "@@ "  , COLOR_MISC    },
+	{ "+"    , COLOR_INS     },
+	{ "-"    , COLOR_DEL     },
+	{ " "    , COLOR_EQUAL   },
+	{ ""     , COLOR_DEFAULT },
+};
+
+static const struct pattern contex_ruleset[] = {
+	{ "*** 0", COLOR_POS1    },
+	{ "--- 0", COLOR_POS2    },
+	{ "*** " , COLOR_FILE1   },
+	{ "--- " , COLOR_FILE2   },
+	{ "*"    , COLOR_MISC    },
+	{ "+ "   , COLOR_INS     },
+	{ "- "   , COLOR_DEL     },
+	{ "! "   , COLOR_CHANGE  },
+	{ "  "   , COLOR_EQUAL   },
+	{ "? "   , COLOR_DEFAULT },
+	{ "??"   , COLOR_MISC    },
+	{ ""     , COLOR_DEFAULT },
+};
+
+static const struct pattern normal_ruleset[] = {
+	{ "0"    , COLOR_MISC   },
+	{ "---"  , COLOR_MISC   },
+	{ "> "   , COLOR_INS    },
+	{ "< "   , COLOR_DEL    },
+	{ ""     , COLOR_DEFAULT },
+};
+
+/* Index zero is used until the format of the diff is known. */
+static const struct pattern *const rulesets[] = {
+	modes,
+	unified_ruleset,
+	contex_ruleset,
+	normal_ruleset
+};
+
+#define RULESET_COUNT (sizeof rulesets / sizeof *rulesets)
+
+
+/* For each ruleset and first byte of a line, index of the first
+ * pattern which may match so most lines are classified without
+ * walking the ruleset. */
+static unsigned char first_rule[RULESET_COUNT][256];
+
+/* Escape sequences which start a line of each color. */
+static char   color_seq[COLOR_COUNT][12];
+static size_t color_len[COLOR_COUNT];
+
+static const char reset_seq[] = "\x1b[0m\n";
+
+
+static void init_tables(void) {
+	const struct pattern *p;
+	unsigned r, ch;
+
+	for (r = 0; r < RULESET_COUNT; ++r) {
+		for (ch = 0; ch < 256; ++ch) {
+			for (p = rulesets[r];
+			     *p->pattern && !match_char(*p->pattern, ch); ++p);
+			first_rule[r][ch] = p - rulesets[r];
+		}
+	}
+
+	for (r = 0; r < COLOR_COUNT; ++r) {
+		color_len[r] = sprintf(color_seq[r], "\x1b[%sm", colors[r]);
+	}
+}
+
+
+static void hold_line(unsigned idx, const char *line, size_t len);
+static void flush_run(void);
+
+
+/* Returns color of a line; detects format of the diff on the way.  The
+ * line ends at end, or later if it is not complete yet. */
+static unsigned classify(unsigned *mode, const char *line, const char *end) {
+	unsigned idx;
+
+	do {
+		idx = find(rulesets[*mode] +
+		           first_rule[*mode][(unsigned char)*line], line, end);
+	} while (!*mode && (*mode = idx));
+	return idx;
+}
+
+
+/* Changed lines of unified diff may need word highlighting. */
+static bool wants_whole(unsigned mode, unsigned idx) {
+	return words && mode == 1 && (idx == COLOR_DEL || idx == COLOR_INS);
+}
+
+
+static void put_line(unsigned mode, unsigned idx,
+                     const char *line, size_t len) {
+	if (wants_whole(mode, idx)) {
+		hold_line(idx, line, len);
+		return;
+	}
+
+	flush_run();
+	out_put(color_seq[idx], color_len[idx]);
+	out_put(line, len);
+	out_put(reset_seq, sizeof reset_seq - 1);
+}
+
+
+#define BLOCK_SIZE (1 << 17)
+
+/* Enough of a line to classify it; patterns are shorter. */
+#define CLASSIFY_BYTES 8
+
+/* With --words longer lines are not compared. */
+#define WORDS_MAX_LINE 4096
+
+/* Lines are streamed: once the beginning of a line is known its colour
+ * is output and the rest is passed through as it comes, so the length
+ * of a line doesn't matter.  Only lines held for --words are waited
+ * for. */
 static void loop(void) {
-	enum color_number {
-		COLOR_DEFAULT, /* must be zero */
-		COLOR_INS,
-		COLOR_DEL,
-		COLOR_CHANGE,
-		COLOR_EQUAL,
-		COLOR_FILE1,
-		COLOR_FILE2,
-		COLOR_POS1,
-		COLOR_POS2,
-		COLOR_MISC
-	};
+	static char buf[BLOCK_SIZE];
+	char *p, *end, *nl;
+	unsigned mode = 0, idx;
+	bool eof = false, in_line = false;
+	size_t len = 0;
+	ssize_t ret;
 
+	init_tables();
 
-	static const char colors[][8] = {
-		[COLOR_DEFAULT] = "0;37",
-		[COLOR_INS]     = "1;32",
-		[COLOR_DEL]     = "1;31",
-		[COLOR_CHANGE]  = "1;33",
-		[COLOR_EQUAL]   = "0;37",
-		[COLOR_FILE1]   = "0;32",
-		[COLOR_FILE2]   = "0;31",
-		[COLOR_POS1]    = "0;32",
-		[COLOR_POS2]    = "0;31",
-		[COLOR_MISC]    = "0;35",
-	};
+	while (!eof) {
+		ret = read(0, buf + len, BLOCK_SIZE - len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read");
+			ret = 0;
+		}
+		eof = !ret;
+		len += ret;
 
+		for (p = buf, end = buf + len; p < end; ) {
+			nl = memchr(p, '\n', end - p);
 
-	static const struct pattern unified_ruleset[] = {
-		{ "+++ " , COLOR_FILE1   },
-		{ "--- " , COLOR_FILE2   },
-		{ "@@ "  , COLOR_MISC    },
-		{ "+"    , COLOR_INS     },
-		{ "-"    , COLOR_DEL     },
-		{ " "    , COLOR_EQUAL   },
-		{ ""     , COLOR_DEFAULT },
-	};
+			if (in_line) {
+				/* Pass rest of the line through */
+				out_put(p, (nl ? nl : end) - p);
+				if (!nl) {
+					p = end;
+					break;
+				}
+				out_put(reset_seq, sizeof reset_seq - 1);
+				in_line = false;
+				p = nl + 1;
+				continue;
+			}
 
-	static const struct pattern contex_ruleset[] = {
-		{ "*** 0", COLOR_POS1    },
-		{ "--- 0", COLOR_POS2    },
-		{ "*** " , COLOR_FILE1   },
-		{ "--- " , COLOR_FILE2   },
-		{ "*"    , COLOR_MISC    },
-		{ "+ "   , COLOR_INS     },
-		{ "- "   , COLOR_DEL     },
-		{ "! "   , COLOR_CHANGE  },
-		{ "  "   , COLOR_EQUAL   },
-		{ "? "   , COLOR_DEFAULT },
-		{ "??"   , COLOR_MISC    },
-		{ ""     , COLOR_DEFAULT },
-	};
+			if (nl || eof) {
+				nl = nl ? nl : end;
+				idx = classify(&mode, p, nl);
+				put_line(mode, idx, p, nl - p);
+				p = nl + 1;
+				continue;
+			}
 
-	static const struct pattern normal_ruleset[] = {
-		{ "0"    , COLOR_MISC   },
-		{ "---"  , COLOR_MISC   },
-		{ "> "   , COLOR_INS    },
-		{ "< "   , COLOR_DEL    },
-		{ ""     , COLOR_DEFAULT },
-	};
+			/* Incomplete line; wait until it can be classified */
+			if (end - p < CLASSIFY_BYTES) {
+				break;
+			}
+			idx = classify(&mode, p, end);
+			if (wants_whole(mode, idx) && end - p <= WORDS_MAX_LINE) {
+				break;
+			}
+			flush_run();
+			out_put(color_seq[idx], color_len[idx]);
+			in_line = true;
+		}
 
-	static const struct pattern *rulesets[] = {
-		0, /* must be at index zero */
-		unified_ruleset,
-		contex_ruleset,
-		normal_ruleset
-	};
+		if (eof && in_line) {
+			out_put(reset_seq, sizeof reset_seq - 1);
+		}
+		len = p < end ? (size_t)(end - p) : 0;
+		if (len && p != buf) {
+			memmove(buf, p, len);
+		}
+		if (eof) {
+			flush_run();
+		}
+		out_flush();
+	}
+}
 
 
-	static const struct pattern modes[] = {
-		{ "-", 1 },
-		{ "*", 2 },
-		{ "0", 3 },
-		{ "",  0 } /* side note: 0 == COLOR_DEFAULT */
-	};
 
+/******************** Word highlighting **************************************/
+/* With --words, runs of removed lines in a unified diff followed by the
+ * same number of added ones are paired up and words which differ within
+ * each pair are highlighted.  Other lines are not held back. */
+#define WORDS_MAX_COST  256  /* see diff_tokens() */
 
-	const struct pattern *ruleset = 0;
-	char buf[4096];
+/* Longer runs are output plainly as they come. */
+#define WORDS_MAX_RUN   1024
+#define WORDS_MAX_HELD  (WORDS_MAX_RUN * WORDS_MAX_LINE)  /* bytes */
 
-	while (fgets(buf, sizeof buf, stdin)) {
-		unsigned idx;
-		char *ch;
+static const char word_on[]  = "\x1b[7m";
+static const char word_off[] = "\x1b[27m";
 
-		do {
-			idx = find(ruleset ? ruleset : modes, buf);
-		} while (!ruleset && (ruleset = rulesets[idx]));
+static struct {
+	struct buffer data, head, tail;
+	struct held { size_t offset, len; } *lines;
+	size_t count, capacity;
+	size_t dels;  /* that many first lines are removed, rest added */
+	bool adding;  /* last line of the run was an added one */
+	bool spilled; /* run got too long and is no longer held */
+} run;
+
+
+static void put_plain(struct buffer *buf, unsigned idx,
+                      const char *line, size_t len) {
+	buffer_put(buf, color_seq[idx], color_len[idx]);
+	buffer_put(buf, line, len);
+	buffer_put(buf, reset_seq, sizeof reset_seq - 1);
+}
+
+
+static bool is_word(char ch) {
+	return isalnum((unsigned char)ch) || ch == '_' || (ch & 0x80);
+}
+
+
+/* Splits line into words, runs of white space and single characters. */
+static size_t tokenize(struct token **tokens, size_t *capacity,
+                       const char *str, size_t len) {
+	const char *const end = str + len, *p;
+	size_t n = 0;
+
+	for (; str < end; str = p, ++n) {
+		p = str + 1;
+		if (is_word(*str)) {
+			while (p < end && is_word(*p)) ++p;
+		} else if (isspace((unsigned char)*str)) {
+			while (p < end && isspace((unsigned char)*p)) ++p;
+		}
+		*tokens = grow(*tokens, capacity, n + 1, sizeof **tokens);
+		(*tokens)[n].str  = str;
+		(*tokens)[n].len  = p - str;
+		(*tokens)[n].hash = hash_bytes(str, p - str);
+	}
+	return n;
+}
+
+
+static void put_words(struct buffer *buf, unsigned idx, const char *line,
+                      const struct token *tokens, size_t n,
+                      const bool *changed) {
+	size_t i, j;
+
+	buffer_put(buf, color_seq[idx], color_len[idx]);
+	buffer_put(buf, line, 1);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && changed[j] == changed[i]; ++j);
+		if (changed[i]) {
+			buffer_put(buf, word_on, sizeof word_on - 1);
+		}
+		buffer_put(buf, tokens[i].str,
+		           tokens[j - 1].str + tokens[j - 1].len - tokens[i].str);
+		if (changed[i]) {
+			buffer_put(buf, word_off, sizeof word_off - 1);
+		}
+	}
+	buffer_put(buf, reset_seq, sizeof reset_seq - 1);
+}
+
+
+/* Tells whether any word, not counting white space, is common. */
+static bool have_common(const struct token *tokens, size_t n,
+                        const bool *changed) {
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		if (!changed[i] && !isspace((unsigned char)*tokens[i].str)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static void highlight_pair(const struct held *del, const struct held *ins) {
+	static struct token *ta, *tb;
+	static bool *ca, *cb;
+	static size_t cap_ta, cap_tb, cap_ca, cap_cb;
+	const char *const a = run.data.data + del->offset;
+	const char *const b = run.data.data + ins->offset;
+	size_t n, m;
+
+	if (del->len > WORDS_MAX_LINE || ins->len > WORDS_MAX_LINE) {
+		goto plain;
+	}
+
+	/* Skip the leading '-' and '+' */
+	n = tokenize(&ta, &cap_ta, a + 1, del->len - 1);
+	m = tokenize(&tb, &cap_tb, b + 1, ins->len - 1);
+	ca = grow(ca, &cap_ca, n + 1, sizeof *ca);
+	cb = grow(cb, &cap_cb, m + 1, sizeof *cb);
+	diff_tokens(ta, n, tb, m, ca, cb, WORDS_MAX_COST);
+
+	/* Highlighting completely different lines is just noise */
+	if (have_common(ta, n, ca)) {
+		put_words(&run.head, COLOR_DEL, a, ta, n, ca);
+		put_words(&run.tail, COLOR_INS, b, tb, m, cb);
+		return;
+	}
+
+plain:
+	put_plain(&run.head, COLOR_DEL, a, del->len);
+	put_plain(&run.tail, COLOR_INS, b, ins->len);
+}
+
+
+/* Outputs held lines, removed ones followed by added ones. */
+static void flush_run(void) {
+	const size_t ins = run.count - run.dels;
+	const bool paired = ins == run.dels;
+	const struct held *line;
+	size_t i;
+
+	run.adding = run.spilled = false;
+	if (!run.count) {
+		return;
+	}
+
+	run.head.len = run.tail.len = 0;
+	for (i = 0, line = run.lines; i < run.count; ++i, ++line) {
+		if (paired && i < run.dels) {
+			highlight_pair(line, line + run.dels);
+		} else if (!paired) {
+			put_plain(i < run.dels ? &run.head : &run.tail,
+			          i < run.dels ? COLOR_DEL : COLOR_INS,
+			          run.data.data + line->offset, line->len);
+		}
+	}
+	out_put(run.head.data, run.head.len);
+	out_put(run.tail.data, run.tail.len);
+
+	run.data.len = run.count = run.dels = 0;
+}
+
+
+static void hold_line(unsigned idx, const char *line, size_t len) {
+	struct held *held;
+
+	size_t i;
+
+	if (idx == COLOR_DEL && run.adding) {
+		flush_run();
+	}
+	run.adding = idx == COLOR_INS;
+
+	if (run.spilled) {
+		out_put(color_seq[idx], color_len[idx]);
+		out_put(line, len);
+		out_put(reset_seq, sizeof reset_seq - 1);
+		return;
+	}
+
+	run.lines = grow(run.lines, &run.capacity, run.count + 1,
+	                 sizeof *run.lines);
+	held = run.lines + run.count++;
+	held->offset = run.data.len;
+	held->len = len;
+	buffer_put(&run.data, line, len);
+	run.dels += idx == COLOR_DEL;
+
+	/* Removed lines come first so held lines are already in order */
+	if (run.count > WORDS_MAX_RUN || run.data.len > WORDS_MAX_HELD) {
+		for (i = 0, held = run.lines; i < run.count; ++i, ++held) {
+			idx = i < run.dels ? COLOR_DEL : COLOR_INS;
+			out_put(color_seq[idx], color_len[idx]);
+			out_put(run.data.data + held->offset, held->len);
+			out_put(reset_seq, sizeof reset_seq - 1);
+		}
+		run.data.len = run.count = run.dels = 0;
+		run.spilled = true;
+	}
+}
+
+
+
+/******************** Built-in unified diff **********************************/
+/* diff -u of two regular files is done without running diff: files are
+ * mapped, split into hashed lines, compared with diff_tokens() and hunks
+ * are printed with colors directly.  Output is usually the same as GNU
+ * diff's; where more equally short diffs exist another may be picked. */
+#define DIFF_MAX_COST 4096
 
-		printf("\x1b[%sm", colors[idx]);
+static long context = 3;
+
+
+/* Parses -u, -U<n> and --unified[=<n>] options (and -r if recursive);
+ * returns whether these are all there is and one of them was given. */
+static bool unified_options(char **argv, size_t n, bool recursive) {
+	bool unified = false;
+	const char *arg, *ch;
+	char *end;
+	size_t i, len;
+
+	for (i = 0; i < n; ++i) {
+		arg = argv[i];
+		if (arg[0] != '-') {
+			return false;
+		} else if (arg[1] == '-') {
+			len = strcspn(arg + 2, "=");
+			if (long_is(arg + 2, len, "unified")) {
+				unified = true;
+				if (arg[2 + len]) {
+					context = strtol(arg + 3 + len, &end, 10);
+					if (*end || context < 0) {
+						return false;
+					}
+				}
+			} else if (!recursive || !long_is(arg + 2, len, "recursive")) {
+				return false;
+			}
+			continue;
+		}
+
+		for (ch = arg + 1; *ch; ++ch) {
+			if (*ch == 'u') {
+				unified = true;
+			} else if (*ch == 'U') {
+				context = strtol(ch + 1, &end, 10);
+				if (end == ch + 1 || *end || context < 0) {
+					return false;
+				}
+				unified = true;
+				break;
+			} else if (*ch != 'r' || !recursive) {
+				return false;
+			}
+		}
+	}
+	return unified;
+}
+
+
+static bool builtin_mode(char **argv) {
+	struct stat st;
+	size_t n;
+
+	for (n = 1; argv[n]; ++n);
+	return n >= 4 && unified_options(argv + 1, n - 3, false) &&
+		!stat(argv[n - 2], &st) && S_ISREG(st.st_mode) &&
+		!stat(argv[n - 1], &st) && S_ISREG(st.st_mode);
+}
+
+
+struct file {
+	const char *name;
+	struct stat st;
+	char *data;
+	size_t size;
+	struct token *lines;
+	size_t count, capacity;
+	bool *changed;
+};
+
+static bool color_output;
+
+
+static bool map_file(struct file *file) {
+	int fd = open(file->name, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &file->st)) {
+		goto error;
+	}
+	file->size = file->st.st_size;
+	file->data = NULL;
+	if (file->size) {
+		file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (file->data == MAP_FAILED) {
+			goto error;
+		}
+		posix_madvise(file->data, file->size, POSIX_MADV_SEQUENTIAL);
+	}
+	close(fd);
+	return true;
+
+error:
+	fprintf(stderr, "diff: %s: %s\n", file->name, strerror(errno));
+	if (fd >= 0) {
+		close(fd);
+	}
+	return false;
+}
+
+
+/* Splits file into lines which include their new line character so the
+ * last line missing one differs from the same line which has it. */
+static void split_lines(struct file *file) {
+	const char *p = file->data, *const end = p + file->size, *nl;
+	struct token *line;
+
+	for (file->count = 0; p < end; p = nl, ++file->count) {
+		nl = memchr(p, '\n', end - p);
+		nl = nl ? nl + 1 : end;
+		file->lines = grow(file->lines, &file->capacity, file->count + 1,
+		                   sizeof *file->lines);
+		line = file->lines + file->count;
+		line->str  = p;
+		line->len  = nl - p;
+		line->hash = hash_bytes(p, nl - p);
+	}
+	file->changed = (bool *)xrealloc(NULL, file->count + 2) + 1;
+}
+
+
+/* Numbers distinct lines of both files and compares the numbers.  Lines
+ * which don't appear in the other file at all are changed for sure and
+ * are left out of the comparison, like diff does, which makes it faster
+ * when files differ a lot. */
+static void diff_lines(struct file *a, struct file *b) {
+	struct file *const files[2] = { a, b };
+	const struct token **classes, *line;
+	size_t *counts[2], size, mask, n, i, k, f, total = a->count + b->count;
+	size_t *class_of[2], *map[2], kept[2];
+	struct token *seq[2];
+	bool *changed[2];
+
+	for (size = 64; size < total * 2; size *= 2);
+	mask = size - 1;
+	classes = xrealloc(NULL, size * sizeof *classes);
+	memset(classes, 0, size * sizeof *classes);
+	for (f = 0; f < 2; ++f) {
+		counts[f] = xrealloc(NULL, size * sizeof **counts);
+		memset(counts[f], 0, size * sizeof **counts);
+		class_of[f] = xrealloc(NULL, (files[f]->count + 1) * sizeof **class_of);
+	}
+
+	/* Slot in the hash table serves as the number of a class */
+	for (f = 0; f < 2; ++f) {
+		for (i = 0; i < files[f]->count; ++i) {
+			line = files[f]->lines + i;
+			for (k = line->hash & mask;
+			     classes[k] && !token_eq(classes[k], line);
+			     k = (k + 1) & mask);
+			classes[k] = line;
+			++counts[f][k];
+			class_of[f][i] = k;
+		}
+	}
+
+	for (f = 0; f < 2; ++f) {
+		n = files[f]->count;
+		seq[f] = xrealloc(NULL, (n + 1) * sizeof **seq);
+		map[f] = xrealloc(NULL, (n + 1) * sizeof **map);
+		changed[f] = xrealloc(NULL, n + 1);
+		for (kept[f] = i = 0; i < n; ++i) {
+			k = class_of[f][i];
+			files[f]->changed[i] = !counts[!f][k];
+			if (counts[!f][k]) {
+				/* Equal numbers make equal tokens */
+				seq[f][kept[f]].str  = NULL;
+				seq[f][kept[f]].len  = 0;
+				seq[f][kept[f]].hash = k;
+				map[f][kept[f]++] = i;
+			}
+		}
+	}
+
+	diff_tokens(seq[0], kept[0], seq[1], kept[1], changed[0], changed[1],
+	            DIFF_MAX_COST);
+
+	for (f = 0; f < 2; ++f) {
+		for (i = 0; i < kept[f]; ++i) {
+			files[f]->changed[map[f][i]] = changed[f][i];
+		}
+		free(counts[f]);
+		free(class_of[f]);
+		free(seq[f]);
+		free(map[f]);
+		free(changed[f]);
+	}
+	free(classes);
+}
+
+
+/* Slides runs of changed lines the way diff does: merge them with
+ * neighbouring runs if possible, then move them down as far as they go
+ * unless that moves them away from a run of changes in the other file.
+ * changed arrays have a false sentinel at both ends. */
+static void shift_changes(struct file *file, const struct file *other) {
+	bool *const changed = file->changed;
+	const bool *const other_changed = other->changed;
+	const size_t end = file->count;
+	size_t i = 0, j = 0, start, length, corresponding;
+
+	for (;;) {
+		/* Find next run, keeping track of where we are in other */
+		while (i < end && !changed[i]) {
+			while (other_changed[j++]);
+			++i;
+		}
+		if (i == end) {
+			break;
+		}
+		for (start = i; changed[++i]; );
+		while (other_changed[j]) ++j;
 
 		do {
-			ch = strchr(buf, '\n');
-			if (ch) {
-				*ch = '\0';
+			length = i - start;
+
+			/* Move up while the last line equals one before */
+			while (start && token_eq(file->lines + start - 1,
+			                         file->lines + i - 1)) {
+				changed[--start] = true;
+				changed[--i] = false;
+				while (changed[start - 1]) --start;
+				while (other_changed[--j]);
+			}
+
+			corresponding = other_changed[j - 1] ? i : end;
+
+			/* Move down while the first line equals one after */
+			while (i != end && token_eq(file->lines + start,
+			                            file->lines + i)) {
+				changed[start++] = false;
+				changed[i++] = true;
+				while (changed[i]) ++i;
+				while (other_changed[++j]) corresponding = i;
+			}
+		} while (length != i - start);
+
+		/* Move back to a corresponding run in other if there is one */
+		while (corresponding < i) {
+			changed[--start] = true;
+			changed[--i] = false;
+			while (other_changed[--j]);
+		}
+	}
+}
+
+
+static void put_diff_line(unsigned idx, char prefix,
+                          const char *line, size_t len) {
+	static struct buffer scratch;
+
+	if (!color_output) {
+		if (prefix) {
+			out_put(&prefix, 1);
+		}
+		out_put(line, len);
+		out_put("\n", 1);
+	} else if (words && (idx == COLOR_DEL || idx == COLOR_INS)) {
+		scratch.len = 0;
+		buffer_put(&scratch, &prefix, 1);
+		buffer_put(&scratch, line, len);
+		hold_line(idx, scratch.data, scratch.len);
+	} else {
+		flush_run();
+		out_put(color_seq[idx], color_len[idx]);
+		if (prefix) {
+			out_put(&prefix, 1);
+		}
+		out_put(line, len);
+		out_put(reset_seq, sizeof reset_seq - 1);
+	}
+}
+
+
+static void put_token(unsigned idx, char prefix, const struct token *line) {
+	static const char no_eol[] = "\\ No newline at end of file";
+	const bool eol = line->str[line->len - 1] == '\n';
+
+	put_diff_line(idx, prefix, line->str, line->len - eol);
+	if (!eol) {
+		put_diff_line(COLOR_DEFAULT, 0, no_eol, sizeof no_eol - 1);
+	}
+}
+
+
+static void put_header(unsigned idx, const char *mark,
+                       const struct file *file) {
+	struct buffer line = { NULL, 0, 0 };
+	struct tm *tm = localtime(&file->st.st_mtim.tv_sec);
+	char stamp[64], zone[8];
+	int len;
+
+	buffer_put(&line, mark, strlen(mark));
+	buffer_put(&line, " ", 1);
+	put_name(&line, file->name);
+	len = strftime(stamp, 32, "\t%Y-%m-%d %H:%M:%S", tm);
+	strftime(zone, sizeof zone, "%z", tm);
+	len += sprintf(stamp + len, ".%09ld %s", file->st.st_mtim.tv_nsec, zone);
+	buffer_put(&line, stamp, len);
+	put_diff_line(idx, 0, line.data, line.len);
+	free(line.data);
+}
+
+
+/* Formats hunk range the way diff -u does. */
+static int format_range(char *buf, size_t start, size_t count) {
+	return count == 1 ? sprintf(buf, "%zu", start + 1)
+		: sprintf(buf, "%zu,%zu", count ? start + 1 : start, count);
+}
+
+
+/* Prints hunks; each starts at a change and takes changes which are no
+ * more than twice the context apart. */
+static void put_hunks(const struct file *a, const struct file *b) {
+	const size_t ctx = context;
+	size_t i = 0, j = 0, hi, hj, ei, ej, gap, k;
+	char buf[64];
+	int len;
+
+	for (;;) {
+		/* Find next change */
+		while (i < a->count && j < b->count &&
+		       !a->changed[i] && !b->changed[j]) {
+			++i;
+			++j;
+		}
+		if (i == a->count && j == b->count) {
+			return;
+		}
+
+		/* Find where the hunk ends */
+		hi = i - (i < ctx ? i : ctx);
+		hj = j - (i - hi);
+		ei = i;
+		ej = j;
+		for (;;) {
+			while (ei < a->count && a->changed[ei]) ++ei;
+			while (ej < b->count && b->changed[ej]) ++ej;
+			for (gap = 0; ei + gap < a->count && ej + gap < b->count &&
+			     !a->changed[ei + gap] && !b->changed[ej + gap] &&
+			     gap <= 2 * ctx; ++gap);
+			if ((ei + gap == a->count && ej + gap == b->count) ||
+			    gap > 2 * ctx) {
+				gap = gap < ctx ? gap : ctx;
+				break;
 			}
-			fputs(buf, stdout);
-		} while (!ch && fgets(buf, sizeof buf, stdin));
-		puts("\x1b[0m");
+			ei += gap;
+			ej += gap;
+		}
+		ei += gap;
+		ej += gap;
+
+		memcpy(buf, "@@ -", 4);
+		len = 4 + format_range(buf + 4, hi, ei - hi);
+		memcpy(buf + len, " +", 2);
+		len += 2 + format_range(buf + len + 2, hj, ej - hj);
+		memcpy(buf + len, " @@", 3);
+		put_diff_line(COLOR_MISC, 0, buf, len + 3);
+
+		/* Context, then removed and added lines of each change */
+		for (i = hi, j = hj; i < ei || j < ej; ) {
+			if (i < ei && j < ej && !a->changed[i] && !b->changed[j]) {
+				put_token(COLOR_EQUAL, ' ', a->lines + i++);
+				++j;
+				continue;
+			}
+			for (k = i; k < ei && a->changed[k]; ++k) {
+				put_token(COLOR_DEL, '-', a->lines + k);
+			}
+			i = k;
+			for (k = j; k < ej && b->changed[k]; ++k) {
+				put_token(COLOR_INS, '+', b->lines + k);
+			}
+			j = k;
+		}
+	}
+}
+
+
+static bool is_binary(const struct file *file) {
+	return memchr(file->data, 0, file->size < 32768 ? file->size : 32768);
+}
+
+
+/* Compares two files; returns exit status the way diff does. */
+static int diff_files(const char *name_a, const char *name_b, bool color) {
+	struct file a, b;
+	int ret = 2;
+
+	memset(&a, 0, sizeof a);
+	memset(&b, 0, sizeof b);
+	a.name = name_a;
+	b.name = name_b;
+	if (!map_file(&a) || !map_file(&b)) {
+		goto done;
+	}
+
+	ret = 0;
+	if (a.size == b.size && (!a.size || !memcmp(a.data, b.data, a.size))) {
+		goto done;
 	}
+
+	ret = 1;
+	color_output = color;
+	if (color) {
+		init_tables();
+	}
+	if (is_binary(&a) || is_binary(&b)) {
+		char *msg = xrealloc(NULL, strlen(a.name) + strlen(b.name) + 32);
+		sprintf(msg, "Binary files %s and %s differ", a.name, b.name);
+		put_diff_line(COLOR_DEFAULT, 0, msg, strlen(msg));
+		free(msg);
+		goto done;
+	}
+
+	split_lines(&a);
+	split_lines(&b);
+	diff_lines(&a, &b);
+	a.changed[-1] = a.changed[a.count] = false;
+	b.changed[-1] = b.changed[b.count] = false;
+	shift_changes(&a, &b);
+	shift_changes(&b, &a);
+
+	put_header(COLOR_FILE2, "---", &a);
+	put_header(COLOR_FILE1, "+++", &b);
+	put_hunks(&a, &b);
+	flush_run();
+
+done:
+	out_flush();
+	if (a.size && a.data) munmap(a.data, a.size);
+	if (b.size && b.data) munmap(b.data, b.size);
+	free(a.lines);
+	free(b.lines);
+	if (a.changed) free(a.changed - 1);
+	if (b.changed) free(b.changed - 1);
+	return ret;
 }
 
 
 
 /******************** String matching ****************************************/
-static bool match(const char *pattern, const char *str);
+static bool match(const char *pattern, const char *str, const char *end);
 
 
-static unsigned find(const struct pattern *patterns, const char *str) {
-	while (!match(patterns->pattern, str)) {
+static unsigned find(const struct pattern *patterns,
+                     const char *str, const char *end) {
+	while (!match(patterns->pattern, str, end)) {
 		++patterns;
 	}
 	return patterns->idx;
 }
 
 
-static bool match(const char *pat, const char *str) {
-	for (;;) {
-		switch (*pat) {
-		case 0:
-			return true;
-		case '?':
-			if (!*str) return false;
-			break;
-		case '0':
-			if (*str < '0' || '9' < *str) return false;
-			break;
-		default:
-			if (*pat != *str) return false;
+static bool match(const char *pat, const char *str, const char *end) {
+	for (; *pat; ++pat, ++str) {
+		if (str == end || !match_char(*pat, *str)) {
+			return false;
 		}
-		++pat;
-		++str;
+	}
+	return true;
+}
+
+
+static bool match_char(char pat, char ch) {
+	switch (pat) {
+	case '?':
+		return ch;
+	case '0':
+		return '0' <= ch && ch <= '9';
+	default:
+		return pat == ch;
 	}
 }
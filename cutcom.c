@@ -20,8 +20,17 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+
+/* Scanning uses SSE2 if the target has it and AVX2 if the CPU turns
+ * out to have it at run time.  __SSE2__ is only ever defined on x86. */
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#  define HAVE_X86_DISPATCH 1
+#  include <immintrin.h>
+#endif
 
 
 struct state_function {
@@ -91,6 +100,194 @@ static const struct state_function s_star[] = {
 };
 
 
+/* State machine above compiled into a table; for each state and input
+ * byte the new state and bytes to output. */
+static const struct state_function *const states[] = {
+	s_text, /* must be first */
+	s_string, s_string_bs, s_char, s_char_bs,
+	s_slash, s_line_comm, s_block_comm, s_star,
+};
+
+#define STATE_COUNT (sizeof states / sizeof *states)
+
+struct transition {
+	unsigned char state, len, out[2];
+};
+
+static struct transition table[STATE_COUNT][256];
+
+/* In most states nearly all bytes leave the state as it is and are
+ * either all copied or all dropped.  Runs of them are skipped in bulk
+ * up to the next of (at most four) interesting bytes. */
+struct skip {
+	unsigned char count, copy, set[4];
+};
+
+static struct skip skips[STATE_COUNT];
+
+
+static void compile(void) {
+	unsigned s, ch, n;
+
+	for (s = 0; s < STATE_COUNT; ++s) {
+		for (ch = 0; ch < 256; ++ch) {
+			const struct state_function *func = states[s];
+			struct transition *t = &table[s][ch];
+			while (func->ch && func->ch!=ch) ++func;
+			for (n = 0; states[n]!=func->new_state; ++n);
+			t->state = n;
+			t->len = 0;
+			if (func->pre_print) t->out[t->len++] = func->pre_print;
+			if (func->print) t->out[t->len++] = ch;
+		}
+	}
+
+	/* A byte is boring if it stays in the state and is output as is,
+	 * or not at all, the same way as 0 (a default transition) is. */
+	for (s = 0; s < STATE_COUNT; ++s) {
+		struct skip *sk = &skips[s];
+		const unsigned copy = table[s][0].len;
+		if (table[s][0].state!=s || copy>1) continue;
+
+		sk->copy = copy;
+		for (ch = 0; ch < 256; ++ch) {
+			const struct transition *t = &table[s][ch];
+			if (t->state==s && t->len==copy && (!copy || t->out[0]==ch)) {
+				continue;
+			} else if (sk->count==4) {
+				sk->count = 0;
+				break;
+			}
+			sk->set[sk->count++] = ch;
+		}
+		for (n = sk->count; n && n < 4; ++n) {
+			sk->set[n] = sk->set[0];
+		}
+	}
+}
+
+
+/* Returns offset of the first byte from set or len if there's none. */
+static size_t scan_scalar(const unsigned char *p, size_t len,
+                          const unsigned char *set) {
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		if (p[i]==set[0] || p[i]==set[1] || p[i]==set[2] || p[i]==set[3]) {
+			break;
+		}
+	}
+	return i;
+}
+
+#ifdef __SSE2__
+static size_t scan_sse2(const unsigned char *p, size_t len,
+                        const unsigned char *set) {
+	const __m128i a = _mm_set1_epi8(set[0]), b = _mm_set1_epi8(set[1]);
+	const __m128i c = _mm_set1_epi8(set[2]), d = _mm_set1_epi8(set[3]);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		const int mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, c), _mm_cmpeq_epi8(v, d))));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+	return i + scan_scalar(p + i, len - i, set);
+}
+#endif
+
+#ifdef HAVE_X86_DISPATCH
+__attribute__((target("avx2")))
+static size_t scan_avx2(const unsigned char *p, size_t len,
+                        const unsigned char *set) {
+	const __m256i a = _mm256_set1_epi8(set[0]), b = _mm256_set1_epi8(set[1]);
+	const __m256i c = _mm256_set1_epi8(set[2]), d = _mm256_set1_epi8(set[3]);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		const unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, a),
+			                _mm256_cmpeq_epi8(v, b)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, c),
+			                _mm256_cmpeq_epi8(v, d))));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+	return i + scan_scalar(p + i, len - i, set);
+}
+#endif
+
+static size_t (*scan)(const unsigned char *p, size_t len,
+                      const unsigned char *set) = scan_scalar;
+
+
+#define BLOCK_SIZE (1 << 16)
+
+static unsigned char in_buf[BLOCK_SIZE], out_buf[BLOCK_SIZE * 2];
+
+
+static int write_all(const unsigned char *buf, size_t len) {
+	ssize_t ret;
+
+	while (len) {
+		ret = write(1, buf, len);
+		if (ret > 0) {
+			buf += ret;
+			len -= ret;
+		} else if (errno!=EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/* Strips comments from fd; returns -1 on read error, -2 on write error. */
+static int cut(int fd) {
+	unsigned state = 0;
+	ssize_t ret;
+
+	while ((ret = read(fd, in_buf, sizeof in_buf))) {
+		const unsigned char *ch = in_buf, *const end = in_buf + ret;
+		unsigned char *out = out_buf;
+
+		if (ret<0) {
+			if (errno==EINTR) continue;
+			return -1;
+		}
+
+		/* Each byte yields at most two, copy both unconditionally */
+		for (; ch!=end; ++ch) {
+			const struct transition *t;
+
+			if (skips[state].count) {
+				const struct skip *sk = &skips[state];
+				size_t run = scan(ch, end - ch, sk->set);
+				if (sk->copy) {
+					memcpy(out, ch, run);
+					out += run;
+				}
+				ch += run;
+				if (ch==end) break;
+			}
+
+			t = &table[state][*ch];
+			out[0] = t->out[0];
+			out[1] = t->out[1];
+			out += t->len;
+			state = t->state;
+		}
+
+		if (write_all(out_buf, out - out_buf)) {
+			return -2;
+		}
+	}
+
+	return 0;
+}
+
+
 int main(int argc, char **argv) {
 	int i;
 
@@ -99,29 +296,37 @@ int main(int argc, char **argv) {
 		argc = 2;
 	}
 
+	compile();
+#ifdef __SSE2__
+	scan = scan_sse2;
+#endif
+#ifdef HAVE_X86_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) scan = scan_avx2;
+#endif
+
 	for (i = 1; i < argc; ++i) {
-		const struct state_function *state = s_text;
-		FILE *fp;
-		int ch;
+		int fd, ret;
 
 		if (argv[i][0]=='-' && argv[i][1]==0) {
-			fp = stdin;
-		} else if (!(fp = fopen(argv[i], "r"))) {
+			fd = 0;
+		} else if ((fd = open(argv[i], O_RDONLY))<0) {
 			fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i],
 			        strerror(errno));
 			continue;
 		}
 
-		while ((ch = getc(fp))!=EOF) {
-			const struct state_function *func = state;
-			while (func->ch && func->ch!=ch) ++func;
-			if (func->pre_print) putchar(func->pre_print);
-			if (func->print) putchar(ch);
-			state = func->new_state;
+		ret = cut(fd);
+		if (ret) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0],
+			        ret==-1 ? argv[i] : "stdout", strerror(errno));
 		}
 
-		if (fp!=stdin) {
-			fclose(fp);
+		if (fd) {
+			close(fd);
+		}
+		if (ret==-2) {
+			return 1;
 		}
 	}
 
@@ -19,18 +19,28 @@
  *   -> http://tinyapps.sourceforge.net/
  */
 
-#define _POSIX_C_SOURCE 2
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -38,6 +48,12 @@
 
 static const char *const MARKER = "{+}";
 
+#define NSEC_PER_SEC 1000000000ull
+/* How long a job has to exit after SIGTERM before it gets SIGKILL. */
+#define KILL_GRACE   (2 * NSEC_PER_SEC)
+/* How many of the slowest jobs -S lists. */
+#define SLOWEST      10
+
 
 static const char *ARGV0;
 
@@ -52,18 +68,41 @@ static void error(const char *fmt, ...) {
 
 static void usage(bool full) {
 	FILE *out = full ? stdout : stderr;
-	fprintf(out, "usage: %s [<options>] [--] <command> <arg>... -- <value> ...\n",
-	        ARGV0);
+	fprintf(out, "usage: %s [<options>] [--] <command> <arg>... -- <value> ...\n"
+	        "       %s -i|-0 [<options>] [--] <command> <arg>...\n",
+	        ARGV0, ARGV0);
 	if (full) {
 		fputs("Possible <options>:\n"
 		      "  -j<jobs> run <jobs> jobs at the same time\n"
 		      "  -J       run one job per processor\n"
+		      "  -L<lim>  vary number of jobs between <min> and <jobs>\n"
+		      "           keeping system load within <lim>\n"
+		      "  -m<min>  run at least <min> jobs with -L; default: 1\n"
+		      "  -a       pin each job slot to a processor and report usage\n"
+		      "  -A       pin each job slot to a NUMA node and report usage\n"
 		      "  -K       stop once a job returns non-zero\n"
+		      "  -t<sec>  kill jobs running longer than <sec> seconds\n"
+		      "  -n<max>  pass up to <max> <value>s to each <command>\n"
+		      "  -s<max>  pass up to <max> bytes of <value>s to each <command>\n"
+		      "  -g       capture output of each job and print it at once\n"
+		      "  -k       like -g but print output in order of <value>s\n"
+		      "  -i       read <value>s from stdin, one per line\n"
+		      "  -0       read <value>s from stdin, separated by NUL bytes\n"
+		      "  -l<file> record exit code of each <value> in <file>\n"
+		      "  -r       with -l, skip <value>s recorded as successful\n"
+		      "           and append to <file> instead of truncating it\n"
+		      "  -S       print resource usage summary of jobs to stderr\n"
+		      "  -Sjson   same but in JSON\n"
 		      "<value>    values to pass to the <command>\n"
 		      "<command>  command to run for each <value>\n"
 		      "<arg>      arguments to pass to the <command>,\n"
-		      "           {+} will be substituted by <value>,\n"
-		      "           if no {+} given, <value> will be passed at the end\n",
+		      "           {+} will be substituted by <value> (or <value>s),\n"
+		      "           if no {+} given, <value> will be passed at the end\n"
+		      "<lim>      comma separated list of:\n"
+		      "             load=<n>  one minute load average\n"
+		      "             cpu=<pct>, memory=<pct>, io=<pct>\n"
+		      "                       pressure stall (PSI) ten second average\n"
+		      "             free=<MiB> available memory\n",
 		      out);
 	} else {
 		fprintf(out, "       %s --help\n", ARGV0);
@@ -71,43 +110,230 @@ static void usage(bool full) {
 }
 
 
+/* With -L number of running jobs is adjusted so these stay within
+ * bounds; zero means no limit. */
+struct limits {
+	double load, pressure[3];
+	unsigned long long free;  /* in kB */
+};
+
+static const char *const PRESSURE[] = { "cpu", "memory", "io" };
+
 struct options {
-	unsigned jobs;
+	unsigned jobs, minJobs;
+	struct limits *limits;
+	uint64_t timeout;
+	/* Limits of values passed to a single command; batchBytes counts
+	 * also pointers in argv. */
+	unsigned long batch;
+	size_t batchBytes;
 	bool keep_going;
+	enum { OUTPUT_DIRECT, OUTPUT_GROUP, OUTPUT_ORDER } output;
+	int delimiter;  /* of values read from stdin; -1 if from argv */
+	enum { PIN_NONE, PIN_CPU, PIN_NODE } pin;
+	const char *journal;
+	bool resume;
+	enum { SUMMARY_NONE, SUMMARY_TEXT, SUMMARY_JSON } summary;
 	const char **values, **command;
 };
 
 
-static unsigned parseJobs(char *arg) {
+static unsigned long parseCount(int opt, char *arg, unsigned long max) {
 	unsigned long val;
 	char *end;
 
 	errno = 0;
 	val = strtoul(arg, &end, 10);
-	if (!val || errno || val > UINT_MAX || *end) {
-		error("-j: %s: invalid argument\n", arg);
+	if (!val || errno || val > max || *end) {
+		error("-%c: %s: invalid argument\n", opt, arg);
 		return 0;
 	}
 
 	return val;
 }
 
+/* How many bytes of values can be passed to the command before
+ * hitting ARG_MAX, taking environment and the command into account. */
+static size_t argBudget(const char **command) {
+	extern char **environ;
+	long max = sysconf(_SC_ARG_MAX);
+	size_t used = 2048;  /* headroom, as xargs does */
+	char **env;
+
+	for (env = environ; *env; ++env) {
+		used += strlen(*env) + 1 + sizeof *env;
+	}
+	for (; *command; ++command) {
+		used += strlen(*command) + 1 + sizeof *command;
+	}
+
+	if (max < _POSIX_ARG_MAX) {
+		max = _POSIX_ARG_MAX;
+	}
+	return (size_t)max > used + 1024 ? (size_t)max - used : 1024;
+}
+
+static struct limits *parseLimits(char *arg) {
+	static struct limits limits;
+	char *tok, *value, *end;
+	double val;
+	unsigned i;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		value = strchr(tok, '=');
+		if (!value) {
+			goto invalid;
+		}
+		*value++ = 0;
+		errno = 0;
+		val = strtod(value, &end);
+		if (!(val > 0) || errno || *end) {
+			goto invalid;
+		}
+
+		if (!strcmp(tok, "load")) {
+			limits.load = val;
+			continue;
+		} else if (!strcmp(tok, "free")) {
+			limits.free = val * 1024;
+			continue;
+		}
+		for (i = 0; i < 3 && strcmp(tok, PRESSURE[i]); ++i);
+		if (i == 3) {
+			goto invalid;
+		}
+		limits.pressure[i] = val;
+	}
+	return &limits;
+
+invalid:
+	error("-L: %s: invalid limit\n", tok);
+	return NULL;
+}
+
+static uint64_t parseTimeout(char *arg) {
+	double val;
+	char *end;
+
+	errno = 0;
+	val = strtod(arg, &end);
+	if (!(val > 0) || errno || val > 1e9 || *end) {
+		error("-t: %s: invalid argument\n", arg);
+		return 0;
+	}
+
+	return val * NSEC_PER_SEC;
+}
+
+/* Reads a list such as "0-3,8,10-11" from a sysfs file. */
+static bool readCpuList(const char *path, cpu_set_t *set) {
+	unsigned long from, to;
+	char buffer[1024], *p, *end;
+	FILE *fd;
+
+	fd = fopen(path, "r");
+	if (!fd) {
+		return false;
+	}
+	p = fgets(buffer, sizeof buffer, fd);
+	fclose(fd);
+
+	CPU_ZERO(set);
+	while (p && *p >= '0' && *p <= '9') {
+		from = to = strtoul(p, &end, 10);
+		if (*end == '-') {
+			to = strtoul(end + 1, &end, 10);
+		}
+		for (; from <= to && from < CPU_SETSIZE; ++from) {
+			CPU_SET(from, set);
+		}
+		p = *end == ',' ? end + 1 : NULL;
+	}
+	return true;
+}
+
+/* Returns CPU limit of cgroup we're in rounded up or zero if none. */
+static unsigned cgroupCpuLimit(void) {
+	unsigned long long quota, period;
+	unsigned limit = 0, l;
+	char buffer[PATH_MAX], path[PATH_MAX + 32], *p = NULL;
+	FILE *fd;
+
+	/* cgroup v2: check cpu.max of our cgroup and all its parents */
+	fd = fopen("/proc/self/cgroup", "r");
+	if (fd) {
+		while ((p = fgets(buffer, sizeof buffer, fd)) &&
+		       strncmp(buffer, "0::/", 4));
+		fclose(fd);
+	}
+	if (p) {
+		p[strcspn(p, "\n")] = 0;
+		p += 3;
+		for (;;) {
+			snprintf(path, sizeof path, "/sys/fs/cgroup%s/cpu.max",
+			         strcmp(p, "/") ? p : "");
+			fd = fopen(path, "r");
+			if (fd) {
+				if (fscanf(fd, "%llu %llu", &quota, &period) == 2 &&
+				    period) {
+					l = (quota + period - 1) / period;
+					limit = !limit || l < limit ? l : limit;
+				}
+				fclose(fd);
+			}
+			if (!strcmp(p, "/")) {
+				break;
+			}
+			*strrchr(p, '/') = 0;
+			if (!*p) {
+				p = (char *)"/";
+			}
+		}
+		if (limit) {
+			return limit;
+		}
+	}
+
+	/* cgroup v1 */
+	fd = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+	if (!fd) {
+		return 0;
+	}
+	l = fscanf(fd, "%llu", &quota);
+	fclose(fd);
+	fd = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+	if (!fd) {
+		return 0;
+	}
+	l = l == 1 && fscanf(fd, "%llu", &period) == 1 && period;
+	fclose(fd);
+	/* Unlimited quota is -1 which fails to parse as unsigned */
+	return l && quota < (1ull << 62) ? (quota + period - 1) / period : 0;
+}
+
+/* Counts CPUs we may run on, taking cgroup CPU quota into account. */
 static unsigned countProcessors(void) {
 	bool ignore = false;
-	unsigned count = 0;
+	unsigned count = 0, limit;
 	char buffer[128];
+	cpu_set_t set;
 	FILE *fd;
 
-	fd = fopen("/proc/cpuinfo", "r");
-	if (!fd) {
-		error("/cpu/info: %s\n", strerror(errno));
-		error("assuming -j1\n");
-		return 1;
+	if (!sched_getaffinity(0, sizeof set, &set)) {
+		count = CPU_COUNT(&set);
+	} else if ((fd = fopen("/proc/cpuinfo", "r"))) {
+		while (fgets(buffer, sizeof buffer, fd)) {
+			count += !ignore && !strncmp(buffer, "processor\t", 10);
+			ignore = !strchr(buffer, '\n');
+		}
+		fclose(fd);
+	} else {
+		error("/proc/cpuinfo: %s\n", strerror(errno));
 	}
 
-	while (fgets(buffer, sizeof buffer, fd)) {
-		count += !ignore && strncmp(buffer, "processor\t", 10);
-		ignore = !strchr(buffer, '\n');
+	limit = cgroupCpuLimit();
+	if (limit && limit < count) {
+		count = limit;
 	}
 
 	if (!count) {
@@ -169,9 +395,20 @@ static int parseArgs(int argc, char **_argv, struct options *opts) {
 	}
 
 	opts->jobs = 1;
+	opts->minJobs = 1;
+	opts->limits = NULL;
 	opts->keep_going = true;
+	opts->output = OUTPUT_DIRECT;
+	opts->timeout = 0;
+	opts->batch = 0;
+	opts->batchBytes = 0;
+	opts->delimiter = -1;
+	opts->pin = PIN_NONE;
+	opts->journal = NULL;
+	opts->resume = false;
+	opts->summary = SUMMARY_NONE;
 	opterr = 0;
-	while ((opt = getopt(argc, _argv, "+:j:JKh")) != -1) {
+	while ((opt = getopt(argc, _argv, "+:j:JL:m:aAKt:n:s:gki0l:rS::h")) != -1) {
 		switch (opt) {
 		case 'h':
 			usage(true);
@@ -179,15 +416,79 @@ static int parseArgs(int argc, char **_argv, struct options *opts) {
 		case 'K':
 			opts->keep_going = false;
 			break;
+		case 't':
+			opts->timeout = parseTimeout(optarg);
+			if (!opts->timeout) {
+				goto usage;
+			}
+			break;
+		case 'g':
+			opts->output = OUTPUT_GROUP;
+			break;
+		case 'k':
+			opts->output = OUTPUT_ORDER;
+			break;
+		case 'i':
+			opts->delimiter = '\n';
+			break;
+		case '0':
+			opts->delimiter = 0;
+			break;
+		case 'l':
+			opts->journal = optarg;
+			break;
+		case 'r':
+			opts->resume = true;
+			break;
+		case 'S':
+			if (!optarg) {
+				opts->summary = SUMMARY_TEXT;
+			} else if (!strcmp(optarg, "json")) {
+				opts->summary = SUMMARY_JSON;
+			} else {
+				error("-S: %s: unknown format\n", optarg);
+				goto usage;
+			}
+			break;
 		case 'j':
-			opts->jobs = parseJobs(optarg);
+			opts->jobs = parseCount('j', optarg, UINT_MAX);
 			if (!opts->jobs) {
 				goto usage;
 			}
 			break;
+		case 'n':
+			opts->batch = parseCount('n', optarg, ULONG_MAX);
+			if (!opts->batch) {
+				goto usage;
+			}
+			break;
+		case 's':
+			opts->batchBytes = parseCount('s', optarg, SIZE_MAX);
+			if (!opts->batchBytes) {
+				goto usage;
+			}
+			break;
 		case 'J':
 			opts->jobs = countProcessors();
 			break;
+		case 'L':
+			opts->limits = parseLimits(optarg);
+			if (!opts->limits) {
+				goto usage;
+			}
+			break;
+		case 'm':
+			opts->minJobs = parseCount('m', optarg, UINT_MAX);
+			if (!opts->minJobs) {
+				goto usage;
+			}
+			break;
+		case 'a':
+			opts->pin = PIN_CPU;
+			break;
+		case 'A':
+			opts->pin = PIN_NODE;
+			break;
 		case ':':
 			error("-%c: requires an argument\n", optopt);
 			goto usage;
@@ -206,9 +507,39 @@ static int parseArgs(int argc, char **_argv, struct options *opts) {
 		goto usage;
 	}
 
-	opts->values = out;
-	takeArguments(&argv, &out, NULL, false);
-	if (!*opts->values) {
+	if (opts->resume && !opts->journal) {
+		error("-r requires -l\n");
+		goto usage;
+	}
+
+	if (opts->minJobs > opts->jobs) {
+		error("-m%u is more than -j%u\n", opts->minJobs, opts->jobs);
+		goto usage;
+	}
+
+	/* One value at a time unless limits were given, then whatever
+	 * fits unless both were given. */
+	if (!opts->batch && !opts->batchBytes) {
+		opts->batch = 1;
+		opts->batchBytes = SIZE_MAX;
+	} else if (!opts->batchBytes) {
+		opts->batchBytes = argBudget(opts->command);
+	} else if (!opts->batch) {
+		opts->batch = ULONG_MAX;
+	}
+
+	/* Command was not terminated by "--"; there are no values. */
+	if (argv > (const char **)_argv + argc) {
+		static const char *none[] = { NULL };
+		opts->values = none;
+	} else {
+		opts->values = out;
+		takeArguments(&argv, &out, NULL, false);
+	}
+	if (opts->delimiter >= 0 && *opts->values) {
+		error("values given on command line and stdin\n");
+		goto usage;
+	} else if (opts->delimiter < 0 && !*opts->values) {
 		error("no values given\n");
 		goto usage;
 	}
@@ -221,82 +552,1262 @@ usage:
 }
 
 
-static bool run(struct options *opts, const char *value) {
-	const char **cmd;
-	pid_t pid;
+/* Output of a job captured with -g or -k. */
+struct buffer {
+	char *data;
+	size_t len, capacity;
+};
+
+struct result {
+	struct result *next;
+	unsigned long index;
+	struct buffer out, err;
+};
+
+struct job {
+	pid_t pid;  /* zero if the slot is free */
+	bool exited;
+	int killed;  /* last signal sent on timeout or termination */
+	int fds[2];  /* stdout and stderr pipes or -1 */
+	uint64_t deadline;  /* when to send next signal or zero */
+	struct result *result;
+	struct buffer values;  /* escaped, one per line, with -l */
+	char *label;  /* first value for -S */
+
+	/* Slot's placement and usage */
+	const cpu_set_t *mask;  /* NULL if not pinned */
+	int place;  /* CPU or node number */
+	uint64_t started, busy;
+	unsigned long count;
+};
+
+struct runner {
+	const struct options *opts;
+	struct job *jobs;
+	struct pollfd *pfds;
+	unsigned running;
+	int rc;
+
+	/* How many jobs may run now; with -L adjusted every second. */
+	unsigned limit;
+	uint64_t nextSample;
 
-	pid = fork();
-	switch (pid) {
-	case -1:
-		error("fork: %s\n", strerror(errno));
+	/* SIGCHLD and termination signals are blocked and read from
+	 * sigfd; children get the original mask back.  A child's pid
+	 * cannot be reused before it's reaped so plain kill() is safe. */
+	int sigfd, terminating;
+	sigset_t sigmask;
+
+	/* Jobs are started with posix_spawn() which avoids copying our
+	 * page tables the way fork() would. */
+	posix_spawnattr_t attr;
+
+	/* Our own affinity; with -a or -A children inherit mask of their
+	 * slot which we take for the duration of posix_spawn(). */
+	cpu_set_t allowed, *masks;
+	uint64_t startTime;
+
+	/* Values left on command line, or ones read from stdin.  Input is
+	 * read only when there's a free slot and no complete value in the
+	 * buffer so a fast producer is held back by the pipe. */
+	const char **value;
+	struct buffer input;
+	size_t inputPos;
+	bool inputEof, wantInput;
+
+	/* How far input has been scanned for a complete batch. */
+	size_t scanPos, scanBytes;
+	unsigned long scanCount;
+
+	/* Values of the next job and its argv. */
+	const char **batch, **argv;
+	size_t batchCapacity, argvCapacity;
+	unsigned long batchCount;
+
+	/* With -l records of finished jobs are buffered and written and
+	 * synced at most once a second so journal doesn't slow down short
+	 * jobs.  A crash loses only the last second which gets rerun. */
+	int journalFd;
+	struct buffer journal;
+	uint64_t journalSync;
+
+	/* With -r values recorded as successful, in a hash table with
+	 * open addressing; strings point to doneData. */
+	struct done { const char *value; size_t len; } *done;
+	size_t doneMask;
+	struct buffer doneData;
+
+	/* With -S resource usage of each finished job and the slowest
+	 * ones, sorted by wall time, longest first. */
+	struct usage {
+		uint64_t wall, user, sys;  /* in ns */
+		uint64_t rss, faults;  /* max RSS in KiB, major faults */
+	} *usage;
+	size_t usageCount, usageCapacity;
+	struct slow {
+		uint64_t wall;
+		pid_t pid;
+		char *label;
+	} slowest[SLOWEST];
+	unsigned slowCount;
+
+	/* Jobs' output is written from the head of the queue.  With -k
+	 * results which finished out of order wait on pending list,
+	 * sorted by index, until all earlier ones are queued. */
+	struct result *queue, **tail, *pending;
+	unsigned long started, queued;
+	size_t written;
+};
+
+
+static void *xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		error("out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static void bufferReserve(struct buffer *buf, size_t len) {
+	if (buf->capacity - buf->len < len) {
+		buf->capacity = buf->len + len < 4096
+			? 4096 : (buf->len + len) * 2;
+		buf->data = xrealloc(buf->data, buf->capacity);
+	}
+}
+
+static void bufferFree(struct buffer *buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = buf->capacity = 0;
+}
+
+
+static void *growArray(void *array, size_t *capacity, size_t need,
+                       size_t size) {
+	if (need > *capacity) {
+		*capacity = need < 16 ? 16 : need * 2;
+		array = xrealloc(array, *capacity * size);
+	}
+	return array;
+}
+
+
+/* Reports a problem with a job; with captured output as part of it. */
+static void report(struct job *job, const char *fmt, ...) {
+	struct buffer *buf;
+	va_list ap;
+	int len;
+
+	if (!job->result) {
+		va_start(ap, fmt);
+		fprintf(stderr, "%s: ", ARGV0);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	buf = &job->result->err;
+	bufferReserve(buf, strlen(ARGV0) + 2);
+	buf->len += sprintf(buf->data + buf->len, "%s: ", ARGV0);
+	for (len = 64; ; ) {
+		bufferReserve(buf, len + 1);
+		va_start(ap, fmt);
+		len = vsnprintf(buf->data + buf->len, buf->capacity - buf->len,
+		                fmt, ap);
+		va_end(ap);
+		if ((size_t)len < buf->capacity - buf->len) {
+			break;
+		}
+	}
+	buf->len += len;
+}
+
+
+static uint64_t timeNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+
+static bool setFlags(int fd, int fl, int fd_fl) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | fl) < 0) {
+		return false;
+	}
+	flags = fcntl(fd, F_GETFD);
+	return flags >= 0 && fcntl(fd, F_SETFD, flags | fd_fl) >= 0;
+}
+
+static void closePipe(int fds[2]) {
+	if (fds[0] >= 0) close(fds[0]);
+	if (fds[1] >= 0) close(fds[1]);
+	fds[0] = fds[1] = -1;
+}
+
+
+/* Describes job for -S by its first value. */
+static char *makeLabel(const struct runner *r) {
+	char *label = xrealloc(NULL, 96);
+	int len = snprintf(label, 64, "%s", r->batch[0]);
+
+	if (len >= 64) {
+		strcpy(label + 60, "...");
+	}
+	if (r->batchCount > 1) {
+		sprintf(label + strlen(label), " (+%lu)", r->batchCount - 1);
+	}
+	return label;
+}
+
+static uint64_t timevalNs(const struct timeval *tv) {
+	return (uint64_t)tv->tv_sec * NSEC_PER_SEC + tv->tv_usec * 1000;
+}
+
+static void recordUsage(struct runner *r, struct job *job, uint64_t wall,
+                        const struct rusage *ru) {
+	struct usage *u;
+	struct slow *s;
+	unsigned i;
+
+	r->usage = growArray(r->usage, &r->usageCapacity, r->usageCount + 1,
+	                     sizeof *r->usage);
+	u = r->usage + r->usageCount++;
+	u->wall = wall;
+	u->user = timevalNs(&ru->ru_utime);
+	u->sys = timevalNs(&ru->ru_stime);
+	u->rss = ru->ru_maxrss;
+	u->faults = ru->ru_majflt;
+
+	/* Insert into the list of slowest jobs dropping the last one */
+	for (i = r->slowCount; i && r->slowest[i - 1].wall < wall; --i);
+	if (i == SLOWEST) {
+		free(job->label);
+	} else {
+		if (r->slowCount == SLOWEST) {
+			free(r->slowest[SLOWEST - 1].label);
+		} else {
+			++r->slowCount;
+		}
+		s = r->slowest + i;
+		memmove(s + 1, s, (r->slowCount - 1 - i) * sizeof *s);
+		s->wall = wall;
+		s->pid = job->pid;
+		s->label = job->label;
+	}
+	job->label = NULL;
+}
+
+
+/* Journal is a text file with a "<status>\t<value>\n" record for each
+ * value whose job finished, where status is the exit code or 128 plus
+ * signal number and backslashes and new lines in value are escaped. */
+
+static size_t hashValue(const char *value, size_t len) {
+	size_t hash = 2166136261u;
+	while (len--) {
+		hash = (hash ^ (unsigned char)*value++) * 16777619u;
+	}
+	return hash;
+}
+
+static struct done *findDone(const struct runner *r, const char *value,
+                             size_t len) {
+	struct done *d;
+	size_t i = hashValue(value, len);
+
+	for (;; ++i) {
+		d = r->done + (i & r->doneMask);
+		if (!d->value || (d->len == len && !memcmp(d->value, value, len))) {
+			return d;
+		}
+	}
+}
+
+static bool isDone(const struct runner *r, const char *value, size_t len) {
+	return r->done && findDone(r, value, len)->value;
+}
+
+/* Reads successful values from the journal.  A partial record left by
+ * a crash is cut off so new ones can be appended after it. */
+static bool loadJournal(struct runner *r) {
+	struct buffer *const buf = &r->doneData;
+	char *line, *end, *value, *in, *out;
+	size_t count = 0, size;
+	ssize_t ret;
+	struct done *d;
+
+	for (;;) {
+		bufferReserve(buf, 65536);
+		ret = read(r->journalFd, buf->data + buf->len,
+		           buf->capacity - buf->len);
+		if (ret > 0) {
+			buf->len += ret;
+		} else if (!ret) {
+			break;
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+
+	for (line = buf->data; (end = memchr(line, '\n',
+	                                     buf->data + buf->len - line)); ) {
+		count += line[0] == '0' && line[1] == '\t';
+		line = end + 1;
+	}
+	if (line != buf->data + buf->len &&
+	    ftruncate(r->journalFd, line - buf->data)) {
+		return false;
+	}
+	buf->len = line - buf->data;
+
+	for (size = 16; size < count * 2; size *= 2);
+	r->doneMask = size - 1;
+	r->done = xrealloc(NULL, size * sizeof *r->done);
+	memset(r->done, 0, size * sizeof *r->done);
+
+	for (line = buf->data; line < buf->data + buf->len; line = end + 1) {
+		end = memchr(line, '\n', buf->data + buf->len - line);
+		if (line[0] != '0' || line[1] != '\t') {
+			continue;
+		}
+		value = out = line + 2;
+		for (in = value; in < end; ++in) {
+			if (*in == '\\' && in + 1 < end) {
+				*out++ = *++in == 'n' ? '\n' : *in;
+			} else {
+				*out++ = *in;
+			}
+		}
+		*out = 0;
+		d = findDone(r, value, out - value);
+		d->value = value;
+		d->len = out - value;
+	}
+	return true;
+}
+
+static bool openJournal(struct runner *r) {
+	const struct options *const opts = r->opts;
+
+	r->journalFd = open(opts->journal, opts->resume
+	                    ? O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC
+	                    : O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0666);
+	if (r->journalFd < 0 || (opts->resume && !loadJournal(r))) {
+		error("%s: %s\n", opts->journal, strerror(errno));
 		return false;
+	}
+	return true;
+}
+
+/* Writes buffered records and syncs them to disk. */
+static void flushJournal(struct runner *r) {
+	struct buffer *const buf = &r->journal;
+	size_t offset = 0;
+	ssize_t ret;
+
+	while (offset < buf->len) {
+		ret = write(r->journalFd, buf->data + offset, buf->len - offset);
+		if (ret > 0) {
+			offset += ret;
+		} else if (errno != EINTR) {
+			error("%s: %s\n", r->opts->journal, strerror(errno));
+			r->rc |= 1;
+			break;
+		}
+	}
+	if (offset && fdatasync(r->journalFd)) {
+		error("%s: %s\n", r->opts->journal, strerror(errno));
+		r->rc |= 1;
+	}
+	buf->len = 0;
+	r->journalSync = 0;
+}
+
+/* Remembers values of a job being started. */
+static void journalStart(struct runner *r, struct job *job) {
+	struct buffer *const buf = &job->values;
+	const char *value;
+	unsigned long i;
 
-	case 0:
-		cmd = opts->command;
-		while (*cmd) {
-			if (*cmd == MARKER) {
-				*cmd = value;
+	buf->len = 0;
+	for (i = 0; i < r->batchCount; ++i) {
+		for (value = r->batch[i]; *value; ++value) {
+			bufferReserve(buf, 3);
+			if (*value == '\\' || *value == '\n') {
+				buf->data[buf->len++] = '\\';
 			}
-			++cmd;
+			buf->data[buf->len++] = *value == '\n' ? 'n' : *value;
 		}
+		bufferReserve(buf, 1);
+		buf->data[buf->len++] = '\n';
+	}
+}
+
+/* Adds records for all values of a job which has finished. */
+static void journalFinish(struct runner *r, struct job *job, int code) {
+	const char *line = job->values.data, *end;
+	const char *const last = line + job->values.len;
+	struct buffer *const buf = &r->journal;
 
-		execvp(opts->command[0], (char **)opts->command);
-		error("%s: %s\n", opts->command[0], strerror(errno));
-		_exit(1);
+	for (; line < last; line = end + 1) {
+		end = memchr(line, '\n', last - line);
+		bufferReserve(buf, end - line + 16);
+		buf->len += sprintf(buf->data + buf->len, "%d\t", code);
+		memcpy(buf->data + buf->len, line, end - line + 1);
+		buf->len += end - line + 1;
 	}
 
+	if (buf->len >= 65536) {
+		flushJournal(r);
+	} else if (!r->journalSync) {
+		r->journalSync = timeNow() + NSEC_PER_SEC;
+	}
+}
+
+
+static bool run(struct runner *r, struct job *job) {
+	const bool capture = r->opts->output != OUTPUT_DIRECT;
+	int out[2] = { -1, -1 }, err[2] = { -1, -1 }, ret;
+	posix_spawn_file_actions_t actions;
+	extern char **environ;
+	pid_t pid;
+
+	if (capture && (pipe(out) || pipe(err))) {
+		error("pipe: %s\n", strerror(errno));
+		closePipe(out);
+		closePipe(err);
+		return false;
+	}
+
+	/* Read ends stay with us, write ends get dup2'ed to stdout and
+	 * stderr so all of them can be closed on exec. */
+	posix_spawn_file_actions_init(&actions);
+	if (r->opts->delimiter >= 0) {
+		posix_spawn_file_actions_addopen(&actions, 0, "/dev/null",
+		                                 O_RDONLY, 0);
+	}
+	if (capture) {
+		setFlags(out[0], O_NONBLOCK, FD_CLOEXEC);
+		setFlags(err[0], O_NONBLOCK, FD_CLOEXEC);
+		setFlags(out[1], 0, FD_CLOEXEC);
+		setFlags(err[1], 0, FD_CLOEXEC);
+		posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+		posix_spawn_file_actions_adddup2(&actions, err[1], 2);
+	}
+
+	if (job->mask) {
+		sched_setaffinity(0, sizeof *job->mask, job->mask);
+	}
+	/* Before spawning so that wall time covers the exec too. */
+	job->started = timeNow();
+	ret = posix_spawnp(&pid, r->argv[0], &actions, &r->attr,
+	                   (char **)r->argv, environ);
+	if (job->mask) {
+		sched_setaffinity(0, sizeof r->allowed, &r->allowed);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	if (ret) {
+		error("%s: %s\n", r->argv[0], strerror(ret));
+		closePipe(out);
+		closePipe(err);
+		r->rc |= 4;
+		return false;
+	}
+
+	job->pid = pid;
+	job->exited = false;
+	job->killed = 0;
+	job->deadline = r->opts->timeout ? job->started + r->opts->timeout : 0;
+	++job->count;
+	job->fds[0] = job->fds[1] = -1;
+	job->result = NULL;
+	if (capture) {
+		close(out[1]);
+		close(err[1]);
+		job->fds[0] = out[0];
+		job->fds[1] = err[0];
+		job->result = xrealloc(NULL, sizeof *job->result);
+		memset(job->result, 0, sizeof *job->result);
+		job->result->index = r->started;
+	}
+	if (r->journalFd >= 0) {
+		journalStart(r, job);
+	}
+	if (r->opts->summary != SUMMARY_NONE) {
+		job->label = makeLabel(r);
+	}
+	++r->started;
 	return true;
 }
 
 
-static bool reap(int *rc, bool block) {
+static void queueResult(struct runner *r, struct result *result) {
+	struct result **p;
+
+	if (r->opts->output == OUTPUT_GROUP) {
+		result->next = NULL;
+		*r->tail = result;
+		r->tail = &result->next;
+		return;
+	}
+
+	for (p = &r->pending; *p && (*p)->index < result->index; p = &(*p)->next);
+	result->next = *p;
+	*p = result;
+
+	while (r->pending && r->pending->index == r->queued) {
+		result = r->pending;
+		r->pending = result->next;
+		result->next = NULL;
+		*r->tail = result;
+		r->tail = &result->next;
+		++r->queued;
+	}
+}
+
+/* A job is done once it exited and all of its output has been read. */
+static void maybeFinish(struct runner *r, struct job *job) {
+	if (!job->exited || job->fds[0] >= 0 || job->fds[1] >= 0) {
+		return;
+	}
+	if (job->result) {
+		queueResult(r, job->result);
+		job->result = NULL;
+	}
+	job->pid = 0;
+	--r->running;
+}
+
+
+static void reap(struct runner *r) {
+	struct job *job, *const end = r->jobs + r->opts->jobs;
+	struct rusage ru;
+	uint64_t wall;
 	int status;
-	pid_t pid = waitpid(-1, &status, block ? 0 : WNOHANG);
-	if (pid <= 0) {
-		return false;
-	} else if (!status) {
-		/* nop */
-	} else if (WIFSIGNALED(status)) {
-		error("[%d]: killed by a signal: %d\n",
-		      pid, WTERMSIG(status));
-		*rc |= 2;
+	pid_t pid;
+
+	while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+		for (job = r->jobs; job < end && job->pid != pid; ++job);
+		if (job == end) {
+			continue;
+		} else if (!status) {
+			/* nop */
+		} else if (WIFSIGNALED(status)) {
+			report(job, "[%d]: killed by a signal: %d\n",
+			       pid, WTERMSIG(status));
+			r->rc |= 2;
+		} else {
+			report(job, "[%d]: exited with exit code: %d\n",
+			       pid, WEXITSTATUS(status));
+			r->rc |= 4;
+		}
+		if (r->journalFd >= 0) {
+			journalFinish(r, job, WIFSIGNALED(status)
+			              ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+		}
+		job->exited = true;
+		wall = timeNow() - job->started;
+		job->busy += wall;
+		if (r->opts->summary != SUMMARY_NONE) {
+			recordUsage(r, job, wall, &ru);
+		}
+		maybeFinish(r, job);
+	}
+}
+
+
+static void readOutput(struct runner *r, struct job *job, unsigned i) {
+	struct buffer *const buf = i ? &job->result->err : &job->result->out;
+	ssize_t ret;
+
+	bufferReserve(buf, 4096);
+	ret = read(job->fds[i], buf->data + buf->len, buf->capacity - buf->len);
+	if (ret > 0) {
+		buf->len += ret;
+	} else if (!ret || (errno != EAGAIN && errno != EINTR)) {
+		close(job->fds[i]);
+		job->fds[i] = -1;
+		maybeFinish(r, job);
+	}
+}
+
+/* Writes as much of the queued output as possible without blocking.  Our
+ * stdout and stderr are shared with the jobs and, on a terminal, with
+ * stdin so they stay blocking; instead each chunk is no bigger than
+ * PIPE_BUF and is only written once poll says the descriptor has room. */
+static void writeOutput(struct runner *r) {
+	struct pollfd pfd = { .events = POLLOUT };
+	struct result *result;
+	struct buffer *buf;
+	size_t offset, len;
+	ssize_t ret;
+	int fd;
+
+	while ((result = r->queue)) {
+		if (r->written < result->out.len) {
+			fd = 1;
+			buf = &result->out;
+			offset = r->written;
+		} else if (r->written - result->out.len < result->err.len) {
+			fd = 2;
+			buf = &result->err;
+			offset = r->written - result->out.len;
+		} else {
+			r->queue = result->next;
+			if (!r->queue) {
+				r->tail = &r->queue;
+			}
+			bufferFree(&result->out);
+			bufferFree(&result->err);
+			free(result);
+			r->written = 0;
+			continue;
+		}
+
+		pfd.fd = fd;
+		if (poll(&pfd, 1, 0) <= 0 || !pfd.revents) {
+			return;
+		}
+		len = buf->len - offset;
+		ret = write(fd, buf->data + offset, len < PIPE_BUF ? len : PIPE_BUF);
+		if (ret >= 0) {
+			r->written += ret;
+		} else if (errno == EAGAIN || errno == EINTR) {
+			return;
+		} else {
+			error("write: %s\n", strerror(errno));
+			r->written += buf->len - offset;
+		}
+	}
+}
+
+
+/* Returns next value or NULL if none is available at the moment. */
+static const char *readValue(struct runner *r) {
+	struct buffer *const in = &r->input;
+	char *p, *value;
+
+	if (r->opts->delimiter < 0) {
+		return *r->value ? *r->value++ : NULL;
+	}
+
+	for (;;) {
+		p = memchr(in->data + r->inputPos, r->opts->delimiter,
+		           in->len - r->inputPos);
+		if (!p) {
+			if (!r->inputEof || r->inputPos == in->len) {
+				return NULL;
+			}
+			/* Last value with no delimiter after it; readInput()
+			 * leaves room for the terminator. */
+			p = in->data + in->len++;
+		}
+		*p = 0;
+		value = in->data + r->inputPos;
+		r->inputPos = p + 1 - in->data;
+		/* Skip empty lines but not empty NUL separated values */
+		if (*value || !r->opts->delimiter) {
+			return value;
+		}
+	}
+}
+
+/* Like readValue() but skips values already done according to -r. */
+static const char *nextValue(struct runner *r) {
+	const char *value;
+	while ((value = readValue(r)) && isDone(r, value, strlen(value)));
+	return value;
+}
+
+static bool moreValues(const struct runner *r) {
+	return r->opts->delimiter < 0
+		? *r->value != NULL
+		: !r->inputEof || r->inputPos < r->input.len;
+}
+
+static void readInput(struct runner *r) {
+	struct buffer *const in = &r->input;
+	ssize_t ret;
+
+	/* Values handed out so far have been passed to jobs already */
+	if (r->inputPos) {
+		in->len -= r->inputPos;
+		memmove(in->data, in->data + r->inputPos, in->len);
+		r->scanPos -= r->inputPos;
+		r->inputPos = 0;
+	}
+
+	bufferReserve(in, 4096);
+	ret = read(0, in->data + in->len, in->capacity - in->len - 1);
+	if (ret > 0) {
+		in->len += ret;
+	} else if (!ret || (errno != EAGAIN && errno != EINTR)) {
+		if (ret) {
+			error("stdin: %s\n", strerror(errno));
+		}
+		r->inputEof = true;
+	}
+}
+
+
+/* Puts back value most recently returned by readValue(). */
+static void ungetValue(struct runner *r, const char *value) {
+	if (r->opts->delimiter < 0) {
+		--r->value;
 	} else {
-		error("[%d]: exited with exit code: %d\n",
-		      pid, WEXITSTATUS(status));
-		*rc |= 4;
+		char *p = r->input.data + (value - r->input.data);
+		p[strlen(p)] = r->opts->delimiter;
+		r->inputPos = p - r->input.data;
+	}
+}
+
+/* Tells whether there's enough input buffered for a full batch. */
+static bool batchReady(struct runner *r) {
+	const struct options *const opts = r->opts;
+	const char *p = r->input.data + r->scanPos, *q;
+	const char *const end = r->input.data + r->input.len;
+
+	while (r->scanCount < opts->batch && r->scanBytes <= opts->batchBytes &&
+	       (q = memchr(p, opts->delimiter, end - p))) {
+		if ((q != p || !opts->delimiter) && !isDone(r, p, q - p)) {
+			++r->scanCount;
+			r->scanBytes += q - p + 1 + sizeof *r->argv;
+		}
+		p = q + 1;
+	}
+	r->scanPos = p - r->input.data;
+	return r->scanCount >= opts->batch || r->scanBytes > opts->batchBytes;
+}
+
+/* Prepares argv for next job in r->argv.  Returns false if there are no
+ * values available at the moment or not enough for a full batch. */
+static bool nextCommand(struct runner *r) {
+	const struct options *const opts = r->opts;
+	const char *value, **cmd;
+	unsigned long count = 0, markers = 0;
+	size_t bytes = 0, n, len;
+
+	if (opts->delimiter >= 0 && !r->inputEof && !batchReady(r)) {
+		return false;
+	}
+
+	while (count < opts->batch && (value = nextValue(r))) {
+		n = strlen(value) + 1 + sizeof *r->argv;
+		if (count && bytes + n > opts->batchBytes) {
+			ungetValue(r, value);
+			break;
+		}
+		r->batch = growArray(r->batch, &r->batchCapacity, count + 1,
+		                     sizeof *r->batch);
+		r->batch[count++] = value;
+		bytes += n;
+	}
+	r->scanPos = r->inputPos;
+	r->scanCount = r->scanBytes = 0;
+	r->batchCount = count;
+	if (!count) {
+		return false;
+	}
+
+	/* Substitute every marker with all the values */
+	for (cmd = opts->command; *cmd; ++cmd) {
+		markers += *cmd == MARKER;
 	}
+	len = cmd - opts->command - markers + markers * count + 1;
+	r->argv = growArray(r->argv, &r->argvCapacity, len, sizeof *r->argv);
+	len = 0;
+	for (cmd = opts->command; *cmd; ++cmd) {
+		if (*cmd != MARKER) {
+			r->argv[len++] = *cmd;
+		} else {
+			memcpy(r->argv + len, r->batch, count * sizeof *r->batch);
+			len += count;
+		}
+	}
+	r->argv[len] = NULL;
 	return true;
 }
 
 
-static int runCommands(struct options *opts) {
-	const char **value;
-	unsigned jobs = 0;
-	int rc = 0;
+/* Assigns CPUs or NUMA nodes to job slots round robin. */
+static void placeSlots(struct runner *r) {
+	const struct options *const opts = r->opts;
+	char path[64];
+	cpu_set_t nodes, mask;
+	unsigned n = 0, i;
+	int *places;
+
+	if (sched_getaffinity(0, sizeof r->allowed, &r->allowed)) {
+		error("sched_getaffinity: %s, not pinning\n", strerror(errno));
+		return;
+	}
+
+	/* Either way there are no more places than CPUs we may use */
+	i = CPU_COUNT(&r->allowed);
+	r->masks = xrealloc(NULL, i * sizeof *r->masks);
+	places = xrealloc(NULL, i * sizeof *places);
 
-	for (value = opts->values;
-	     *value && (opts->keep_going || !rc);
-	     ++value) {
-		if (!run(opts, *value)) {
+	if (opts->pin == PIN_CPU) {
+		for (i = 0; i < CPU_SETSIZE; ++i) {
+			if (CPU_ISSET(i, &r->allowed)) {
+				CPU_ZERO(r->masks + n);
+				CPU_SET(i, r->masks + n);
+				places[n++] = i;
+			}
+		}
+	} else if (readCpuList("/sys/devices/system/node/online", &nodes)) {
+		for (i = 0; i < CPU_SETSIZE; ++i) {
+			sprintf(path, "/sys/devices/system/node/node%u/cpulist", i);
+			if (!CPU_ISSET(i, &nodes) || !readCpuList(path, &mask)) {
+				continue;
+			}
+			/* Nodes we may not use take no room in masks */
+			CPU_AND(&mask, &mask, &r->allowed);
+			if (CPU_COUNT(&mask)) {
+				r->masks[n] = mask;
+				places[n++] = i;
+			}
+		}
+	}
+
+	if (!n) {
+		error("no NUMA nodes found, not pinning\n");
+	}
+	for (i = 0; n && i < opts->jobs; ++i) {
+		r->jobs[i].mask = r->masks + i % n;
+		r->jobs[i].place = places[i % n];
+	}
+	free(places);
+}
+
+/* Prints how busy each slot was with -a or -A. */
+static void reportSlots(const struct runner *r) {
+	const uint64_t total = timeNow() - r->startTime;
+	const struct job *job, *const end = r->jobs + r->opts->jobs;
+
+	for (job = r->jobs; job < end && job->mask; ++job) {
+		error("slot %u (%s %d): %lu jobs, %.1f%% busy\n",
+		      (unsigned)(job - r->jobs),
+		      r->opts->pin == PIN_CPU ? "cpu" : "node", job->place,
+		      job->count, total ? job->busy * 100.0 / total : 0.0);
+	}
+}
+
+
+/* Sends sig to all running jobs; SIGKILL after grace period. */
+static void killJobs(struct runner *r, int sig) {
+	struct job *job, *const end = r->jobs + r->opts->jobs;
+	for (job = r->jobs; job < end; ++job) {
+		if (job->pid && !job->exited) {
+			kill(job->pid, sig);
+			job->killed = sig;
+			job->deadline = sig == SIGKILL ? 0 : timeNow() + KILL_GRACE;
+		}
+	}
+}
+
+/* Tells whether system is over any of the -L limits. */
+static bool overloaded(const struct limits *limits) {
+	unsigned long long avail;
+	char buffer[128], path[32];
+	double val;
+	unsigned i;
+	FILE *fd;
+
+	if (limits->load && (fd = fopen("/proc/loadavg", "r"))) {
+		i = fscanf(fd, "%lf", &val);
+		fclose(fd);
+		if (i == 1 && val >= limits->load) {
+			return true;
+		}
+	}
+
+	for (i = 0; i < 3; ++i) {
+		if (!limits->pressure[i]) {
+			continue;
+		}
+		sprintf(path, "/proc/pressure/%s", PRESSURE[i]);
+		fd = fopen(path, "r");
+		if (fd) {
+			bool over = fscanf(fd, "some avg10=%lf", &val) == 1 &&
+				val >= limits->pressure[i];
+			fclose(fd);
+			if (over) {
+				return true;
+			}
+		}
+	}
+
+	if (limits->free && (fd = fopen("/proc/meminfo", "r"))) {
+		avail = 0;
+		while (fgets(buffer, sizeof buffer, fd) &&
+		       sscanf(buffer, "MemAvailable: %llu", &avail) != 1);
+		fclose(fd);
+		if (avail && avail < limits->free) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Moves the limit by a quarter (but at least one) towards -m when
+ * overloaded and towards -j otherwise. */
+static void adjustLimit(struct runner *r) {
+	const struct options *const opts = r->opts;
+	unsigned step = r->limit / 4 ? r->limit / 4 : 1;
+
+	if (overloaded(opts->limits)) {
+		r->limit = r->limit - opts->minJobs > step
+			? r->limit - step : opts->minJobs;
+	} else {
+		r->limit = opts->jobs - r->limit > step
+			? r->limit + step : opts->jobs;
+	}
+}
+
+/* Handles expired deadlines and returns poll() timeout till the next. */
+static int checkDeadlines(struct runner *r) {
+	struct job *job, *const end = r->jobs + r->opts->jobs;
+	uint64_t now = timeNow(), next = 0;
+
+	if (r->nextSample) {
+		if (r->nextSample <= now) {
+			adjustLimit(r);
+			r->nextSample = now + NSEC_PER_SEC;
+		}
+		next = r->nextSample;
+	}
+
+	if (r->journalSync) {
+		if (r->journalSync <= now) {
+			flushJournal(r);
+		} else if (!next || r->journalSync < next) {
+			next = r->journalSync;
+		}
+	}
+
+	for (job = r->jobs; job < end; ++job) {
+		if (!job->pid || job->exited || !job->deadline) {
 			continue;
 		}
+		if (job->deadline <= now) {
+			if (!job->killed) {
+				report(job, "[%d]: timed out\n", job->pid);
+			}
+			job->killed = job->killed ? SIGKILL : SIGTERM;
+			kill(job->pid, job->killed);
+			job->deadline = job->killed == SIGKILL ? 0 : now + KILL_GRACE;
+		}
+		if (job->deadline && (!next || job->deadline < next)) {
+			next = job->deadline;
+		}
+	}
+
+	/* Round up so we don't wake up just before the deadline */
+	return next ? (int)((next - now + 999999) / 1000000) : -1;
+}
+
+static void readSignals(struct runner *r) {
+	struct signalfd_siginfo si;
+
+	while (read(r->sigfd, &si, sizeof si) == sizeof si) {
+		if (si.ssi_signo == SIGCHLD) {
+			reap(r);
+		} else if (!r->terminating) {
+			/* Stop starting jobs and pass the signal on */
+			r->terminating = si.ssi_signo;
+			killJobs(r, si.ssi_signo);
+		} else {
+			killJobs(r, SIGKILL);
+		}
+	}
+}
+
+
+/* Waits for a child to exit, a signal, a timeout, values or output to
+ * arrive or output to become writable. */
+static void waitForEvents(struct runner *r) {
+	struct pollfd *pfd = r->pfds, *inputPfd = NULL;
+	struct job *job, *const end = r->jobs + r->opts->jobs;
+	unsigned i;
+	int timeout;
+
+	pfd->fd = r->sigfd;
+	pfd->events = POLLIN;
+	++pfd;
+	for (job = r->jobs; job < end; ++job) {
+		for (i = 0; job->pid && i < 2; ++i) {
+			if (job->fds[i] >= 0) {
+				pfd->fd = job->fds[i];
+				pfd->events = POLLIN;
+				++pfd;
+			}
+		}
+	}
+	if (r->queue) {
+		pfd->fd = r->written < r->queue->out.len ? 1 : 2;
+		pfd->events = POLLOUT;
+		++pfd;
+	}
+	if (r->wantInput) {
+		inputPfd = pfd;
+		pfd->fd = 0;
+		pfd->events = POLLIN;
+		++pfd;
+	}
 
-		++jobs;
-		while (reap(&rc, jobs >= opts->jobs)) {
-			--jobs;
+	timeout = checkDeadlines(r);
+	if (poll(r->pfds, pfd - r->pfds, timeout) < 0) {
+		if (errno != EINTR) {
+			error("poll: %s\n", strerror(errno));
+			exit(1);
 		}
+		return;
 	}
 
-	if (*value) {
+	pfd = r->pfds + 1;
+	for (job = r->jobs; job < end; ++job) {
+		for (i = 0; job->pid && i < 2; ++i) {
+			if (job->fds[i] >= 0 && (pfd++)->revents) {
+				readOutput(r, job, i);
+			}
+		}
+	}
+	if (r->pfds->revents) {
+		readSignals(r);
+	}
+	if (r->queue) {
+		writeOutput(r);
+	}
+	if (inputPfd && inputPfd->revents) {
+		readInput(r);
+	}
+}
+
+
+static int compareU64(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Prints a string as a JSON literal. */
+static void printJsonString(const char *str) {
+	fputc('"', stderr);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\') {
+			fprintf(stderr, "\\%c", *str);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(stderr, "\\u%04x", *str);
+		} else {
+			fputc(*str, stderr);
+		}
+	}
+	fputc('"', stderr);
+}
+
+/* Prints minimum, 50th, 90th and 99th percentile and maximum of each
+ * resource usage counter and the slowest jobs. */
+static void printSummary(const struct runner *r) {
+	static const struct {
+		const char *name, *unit;
+		size_t offset;
+		bool time;
+	} METRICS[] = {
+		{ "wall", "s", offsetof(struct usage, wall), true },
+		{ "user", "s", offsetof(struct usage, user), true },
+		{ "sys", "s", offsetof(struct usage, sys), true },
+		{ "maxrss", "KiB", offsetof(struct usage, rss), false },
+		{ "majflt", "", offsetof(struct usage, faults), false },
+	};
+	static const unsigned PERCENTILES[] = { 0, 50, 90, 99, 100 };
+	static const char *const NAMES[] = { "min", "p50", "p90", "p99", "max" };
+	const bool json = r->opts->summary == SUMMARY_JSON;
+	const size_t n = r->usageCount;
+	uint64_t *values, v;
+	unsigned m, p;
+	size_t i;
+
+	if (json) {
+		fprintf(stderr, "{\"jobs\":%zu,\"elapsed\":%.3f", n,
+		        (timeNow() - r->startTime) / 1e9);
+	} else {
+		fprintf(stderr, "%s: %zu jobs in %.3fs\n%-8s", ARGV0, n,
+		        (timeNow() - r->startTime) / 1e9, "");
+		for (p = 0; p < 5; ++p) {
+			fprintf(stderr, " %10s", NAMES[p]);
+		}
+		fputc('\n', stderr);
+	}
+
+	values = xrealloc(NULL, (n ? n : 1) * sizeof *values);
+	for (m = 0; n && m < sizeof METRICS / sizeof *METRICS; ++m) {
+		for (i = 0; i < n; ++i) {
+			memcpy(values + i, (const char *)(r->usage + i) +
+			       METRICS[m].offset, sizeof *values);
+		}
+		qsort(values, n, sizeof *values, compareU64);
+
+		if (json) {
+			fprintf(stderr, ",\"%s\":{", METRICS[m].name);
+		} else {
+			fprintf(stderr, "%-8s", METRICS[m].name);
+		}
+		for (p = 0; p < 5; ++p) {
+			/* Nearest rank: ceil(p * n / 100), counting from 1 */
+			i = (n * PERCENTILES[p] + 99) / 100;
+			v = values[i ? i - 1 : 0];
+			if (json && METRICS[m].time) {
+				fprintf(stderr, "%s\"%s\":%.6f", p ? "," : "",
+				        NAMES[p], v / 1e9);
+			} else if (json) {
+				fprintf(stderr, "%s\"%s\":%llu", p ? "," : "",
+				        NAMES[p], (unsigned long long)v);
+			} else if (METRICS[m].time) {
+				fprintf(stderr, " %9.3f%s", v / 1e9, METRICS[m].unit);
+			} else {
+				fprintf(stderr, " %*llu%s",
+				        10 - (int)strlen(METRICS[m].unit),
+				        (unsigned long long)v, METRICS[m].unit);
+			}
+		}
+		fputs(json ? "}" : "\n", stderr);
+	}
+	free(values);
+
+	if (json) {
+		fputs(",\"slowest\":[", stderr);
+	} else if (r->slowCount) {
+		fputs("slowest:\n", stderr);
+	}
+	for (m = 0; m < r->slowCount; ++m) {
+		if (json) {
+			fprintf(stderr, "%s{\"pid\":%d,\"wall\":%.6f,\"value\":",
+			        m ? "," : "", (int)r->slowest[m].pid,
+			        r->slowest[m].wall / 1e9);
+			printJsonString(r->slowest[m].label);
+			fputc('}', stderr);
+		} else {
+			fprintf(stderr, "  %9.3fs [%d]: %s\n",
+			        r->slowest[m].wall / 1e9, (int)r->slowest[m].pid,
+			        r->slowest[m].label);
+		}
+	}
+	if (json) {
+		fputs("]}\n", stderr);
+	}
+}
+
+
+static int runCommands(struct options *opts) {
+	struct runner r;
+	sigset_t set;
+	bool stopping;
+	unsigned i;
+
+	memset(&r, 0, sizeof r);
+	r.opts = opts;
+	r.tail = &r.queue;
+	r.jobs = xrealloc(NULL, opts->jobs * sizeof *r.jobs);
+	memset(r.jobs, 0, opts->jobs * sizeof *r.jobs);
+	r.pfds = xrealloc(NULL, (opts->jobs * 2 + 3) * sizeof *r.pfds);
+	r.value = opts->values;
+	r.journalFd = -1;
+	if (opts->journal && !openJournal(&r)) {
+		return 1;
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	sigprocmask(SIG_BLOCK, &set, &r.sigmask);
+	r.sigfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (r.sigfd < 0) {
+		error("signalfd: %s\n", strerror(errno));
+		return 1;
+	}
+	r.startTime = timeNow();
+	r.limit = opts->jobs;
+	if (opts->limits) {
+		/* Start low and ramp up while there's capacity */
+		r.limit = opts->minJobs;
+		r.nextSample = r.startTime + NSEC_PER_SEC;
+	}
+	if (opts->pin != PIN_NONE) {
+		placeSlots(&r);
+	}
+
+	posix_spawnattr_init(&r.attr);
+	posix_spawnattr_setsigmask(&r.attr, &r.sigmask);
+	posix_spawnattr_setflags(&r.attr, POSIX_SPAWN_SETSIGMASK);
+
+	for (;;) {
+		stopping = r.terminating || (!opts->keep_going && r.rc);
+		i = 0;
+		while (r.running < r.limit && !stopping && nextCommand(&r)) {
+			while (r.jobs[i].pid) {
+				++i;
+			}
+			if (run(&r, r.jobs + i)) {
+				++r.running;
+			}
+			/* Failing to start a job counts like a failed job */
+			stopping = r.terminating || (!opts->keep_going && r.rc);
+		}
+
+		r.wantInput = opts->delimiter >= 0 && !r.inputEof && !stopping &&
+			r.running < r.limit;
+		if (!r.running && !r.queue && !r.wantInput) {
+			break;
+		}
+		waitForEvents(&r);
+	}
+
+	if (moreValues(&r)) {
 		error("terminating before all jobs were started\n");
 	}
+	if (opts->pin != PIN_NONE) {
+		reportSlots(&r);
+	}
+	if (opts->summary != SUMMARY_NONE) {
+		printSummary(&r);
+		for (i = 0; i < r.slowCount; ++i) {
+			free(r.slowest[i].label);
+		}
+		free(r.usage);
+	}
 
-	while (jobs > 0) {
-		reap(&rc, true);
-		--jobs;
+	if (r.journalFd >= 0) {
+		flushJournal(&r);
+		close(r.journalFd);
+		for (i = 0; i < opts->jobs; ++i) {
+			bufferFree(&r.jobs[i].values);
+		}
+		bufferFree(&r.journal);
+		bufferFree(&r.doneData);
+		free(r.done);
 	}
+	close(r.sigfd);
+	posix_spawnattr_destroy(&r.attr);
+	bufferFree(&r.input);
+	free(r.batch);
+	free(r.argv);
+	free(r.masks);
+	free(r.pfds);
+	free(r.jobs);
 
-	return rc;
+	/* Die of the same signal so our parent knows what happened */
+	if (r.terminating) {
+		signal(r.terminating, SIG_DFL);
+		sigprocmask(SIG_SETMASK, &r.sigmask, NULL);
+		raise(r.terminating);
+	}
+	return r.rc;
 }
 
 
@@ -20,7 +20,7 @@
  */
 
 
-#define APP_VERSION "0.19"
+#define APP_VERSION "0.23"
 
 #define HAVE_ICONV 1
 
@@ -29,10 +29,12 @@
 #define _DEFAULT_SOURCE
 
 #include <errno.h>
+#include <poll.h>
 #include <stdint.h>
 #include <wchar.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <stdio.h>
 #include <string.h>
@@ -40,6 +42,12 @@
 #include <signal.h>
 #include <limits.h>
 #include <locale.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
 
 #if HAVE_ICONV
 #  include <iconv.h>
@@ -80,6 +88,8 @@ static void _die(int perr, const char *fmt, ...)
 #define DEFAULT_HOST    "localhost"
 #define DEFAULT_PORT    6600
 #define DEFAULT_COLUMNS 80
+#define NSEC_PER_SEC    1000000000ull
+#define POLL_PERIOD     NSEC_PER_SEC
 #define DEFAULT_FORMAT \
 	"[[[%artist% <&%album%> ]|%artist% - |<%album%> ]" \
 	"&[[%track%. &%title%]|%title%]]"  \
@@ -98,40 +108,70 @@ static void parseArguments(int argc, char **argv)
 	__attribute__((nonnull));
 static void daemonize(void);
 static void registerSignalHandlers(void);
+static void shareInit(void);
 
-static int  connectToMPD(unsigned timeout);
+static void pollServers(int query, uint64_t now);
+static void connectToMPD(unsigned timeout, uint64_t now);
+static void readGreeting(uint64_t now);
+static void failConnection(int code, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
 static void disconnectFromMPD(void);
-static int  getSong(void);
-static void display(unsigned secs);
+static void disconnectAll(void);
+static void sendQuery(uint64_t now);
+static void awaitReply(int what, uint64_t now);
+static void readReply(uint64_t now);
+static int  gotStatus(void);
+static void gotSong(void);
+static void scrollLines(void);
+static void display(void);
+
+static uint64_t timeNow(void);
+static uint64_t nextDeadline(uint64_t deadline, uint64_t period, uint64_t now)
+	__attribute__((const));
+static uint64_t nextWakeup(uint64_t pollAt, uint64_t scrollAt)
+	__attribute__((pure));
+static void sleepUntil(uint64_t deadline);
 
 static void initCodesets(void);
 
 static int  done(void);
 static int  error(void) __attribute__((pure));
+static uint64_t scrollPeriod(void) __attribute__((pure));
 
 
 int main(int argc, char **argv) {
-	unsigned timeout = 1, connected = 0;
+	uint64_t now, pollAt, scrollAt;
 
 	initCodesets();
 	parseArguments(argc, argv);
 	daemonize();
 	registerSignalHandlers();
+	shareInit();
 	termInit();
-	atexit(disconnectFromMPD);
+	atexit(disconnectAll);
 
+	/* Status polling, scrolling and reconnecting all have their own
+	 * absolute deadlines so neither drifts with the time spent
+	 * talking to MPD. */
+	pollAt = scrollAt = timeNow();
 	do {
-		if (!connected) {
-			timeout = timeout <= 30 ? timeout * 2 : 60;
-			connected = connectToMPD(timeout > 10 ? 10 : timeout);
+		int query;
+
+		now = timeNow();
+		query = now >= pollAt;
+		if (query) {
+			pollAt = nextDeadline(pollAt, POLL_PERIOD, now);
 		}
+		pollServers(query, timeNow());
 
-		if (connected) {
-			timeout = 1;
-			connected = getSong();
+		now = timeNow();
+		if (now >= scrollAt) {
+			scrollAt = nextDeadline(scrollAt, scrollPeriod(), now);
+			scrollLines();
 		}
 
-		display(timeout);
+		display();
+		sleepUntil(nextWakeup(pollAt, scrollAt));
 	} while (!done());
 
 	return 0;
@@ -139,22 +179,22 @@ int main(int argc, char **argv) {
 
 
 /******************** Global data *******************************************/
-struct {
+struct state {
+	int error;
+	int state;
+	int songid;
+	int pos;
+	int len;
+	unsigned hilightPos;
+	unsigned scroll;
+	unsigned columns;
+};
+
+struct server {
 	mpd_Connection *conn;
 	mpd_InfoEntity *info;
 
-	struct state {
-		int error;
-		int state;
-		int songid;
-		int pos;
-		int len;
-		unsigned hilightPos;
-		unsigned scroll;
-		unsigned columns;
-	} cur, old;
-
-	const wchar_t *format;
+	struct state cur, old;
 
 	wchar_t *line;
 	size_t line_len, line_capacity;
@@ -163,18 +203,65 @@ struct {
 	const char *password;
 	unsigned short port;
 
+	/* Either error or, when following, message. */
+	const char *errorStr;
+	char *message;
+	char error[MPD_ERRORSTR_MAX_LENGTH + 1];
+
+	/* A server is either disconnected, connecting (waiting for the
+	 * greeting) or connected; a connected one may be waiting for
+	 * reply to one of the commands below.  Connecting and waiting
+	 * end at timeoutAt at the latest. */
+	unsigned short connected, connecting;
+	enum {
+		WAIT_NONE, WAIT_PASSWORD, WAIT_STATUS, WAIT_SONG
+	} waiting;
+	unsigned backoff;
+	uint64_t reconnectAt, timeoutAt;
+	int fresh;
+};
+
+struct {
+	struct server *servers;
+	struct pollfd *pollfds;
+	unsigned count;
+
+	const wchar_t *format;
+	uint64_t scrollPeriod;
+	int scrolling;
+
 	unsigned short background;
+	enum {
+		OUTPUT_TERM, OUTPUT_PLAIN, OUTPUT_JSON, OUTPUT_PUBLISH
+	} output;
+
+	/* Sharing state with other instances, see "Sharing state" */
+	const char *publishPath, *followPath;
+	int shareFd;
+	int *followers;
+	unsigned followersCount;
+	unsigned followBackoff;
+	uint64_t followReconnectAt;
+	struct sockaddr_un shareAddr;
 
 	volatile sig_atomic_t gotSignal;
 	volatile sig_atomic_t width;
 } D;
 
+/* Server currently being handled.  Connection, formatting and output
+ * functions all operate on it. */
+static struct server *S;
+
 static int  done(void) {
 	return D.gotSignal;
 }
 
 static int  error(void) {
-	return !!(D.conn->error);
+	return !!(S->conn->error);
+}
+
+static uint64_t scrollPeriod(void) {
+	return D.scrollPeriod;
 }
 
 
@@ -183,32 +270,44 @@ static void handleSignal(int sig) __attribute__((cold));
 static void handleResize(int sig) __attribute__((cold));
 
 static const wchar_t *wideFromMulti(const char *str) __attribute__((nonnull));
+static void parseServer(struct server *srv, char *hostarg, const char *portarg)
+	__attribute__((nonnull(1, 2)));
 
 static void usage(void) __attribute__((noreturn));
 static void usage(void)
 {
 	printf("mpd-show  " APP_VERSION " (c) 2005-2011 by Michal Nazarewicz (mina86/AT/mina86.com)\n"
-	       "usage: %s [ <options> ] [ <host>[:<port> | <port> ]]\n"
+	       "usage: %s [ <options> ] [ <host>[:<port>] ... | <host> <port> ]\n"
 	       " -b -B   runs in background mode; -B also forks into background\n"
+	       " -p -j   prints a tab separated (-p) or JSON (-j) record each time state\n"
+	       "         changes instead of drawing on terminal; meant for status bars\n"
+	       " -P<sock> talks to MPD and publishes its state on <sock> Unix socket\n"
+	       "         instead of displaying it\n"
+	       " -F<sock> displays state published on <sock> by another instance rather\n"
+	       "         than talking to MPD; <host> and <port> are ignored\n"
 	       " -c<col> assumes <col>-char wide term [$COLUMNS or %d]"
 #if HAVE_RESIZE
 	       " (obsolete)"
 #endif
 	       "\n"
+	       " -s<cps> scrolls long lines by <cps> characters per second [1]\n"
 	       " -f<fmt> uses <fmt> for displaying song (see mpc(1)); supports following tags:\n",
 	       argv0, DEFAULT_COLUMNS);
 	printf("         album, artist, comment, composer, date, dir, disc, file, filenoext,\n"
 	       "         genre, name, path, pathnoext, time, title, track and Y pseudo tag.\n"
 	       " <host>  host MPD is listening on optionally prefixed with '<password>@'\n"
 	       "                                  [$MPD_HOST or " DEFAULT_HOST "]\n"
-	       " <port>  port MPD is listening on [$MPD_PORT or %u]\n",
+	       "         if several hosts are given, each is shown in its own line\n"
+	       " <port>  port MPD is listening on [$MPD_PORT or %u]\n"
+	       "         a port given after <host> takes precedence over $MPD_PORT\n",
 	       DEFAULT_PORT);
 	exit(0);
 }
 
 
 static void parseArguments(int argc, char **argv) {
-	const char *hostarg = 0, *portarg = 0, *format;
+	const char *portarg = 0, *format;
+	unsigned columns = 0, i;
 	char *end;
 	int opt;
 
@@ -224,20 +323,29 @@ static void parseArguments(int argc, char **argv) {
 
 	/* Some defaults */
 	format = DEFAULT_FORMAT;
+	D.scrollPeriod = NSEC_PER_SEC;
+
+	/* There cannot be more servers than arguments */
+	D.servers = calloc(argc, sizeof *D.servers);
+	pdie_on(!D.servers, "malloc");
 
 	/* Get opts */
-	while ((opt = getopt(argc, argv, "-hbBc:f:"))!=-1) {
+	while ((opt = getopt(argc, argv, "-hbBc:f:s:pjP:F:"))!=-1) {
 		switch (opt) {
 		case 'h': usage();
 		case 'b': D.background = 1; break;
 		case 'B': D.background = 2; break;
+		case 'p': D.output = OUTPUT_PLAIN; break;
+		case 'j': D.output = OUTPUT_JSON; break;
+		case 'P': D.publishPath = optarg; break;
+		case 'F': D.followPath = optarg; break;
 
 			/* Columns */
 		case 'c': {
 			unsigned long c = strtoul(optarg, &end, 0);
 			die_on(c < 3 || c > UINT_MAX || *end,
 				   "invalid terminal width: %s", optarg);
-			D.cur.columns = c;
+			columns = c;
 			break;
 		}
 
@@ -246,11 +354,19 @@ static void parseArguments(int argc, char **argv) {
 			format = optarg;
 			break;
 
+			/* Scroll speed */
+		case 's': {
+			double cps = strtod(optarg, &end);
+			die_on(!(cps >= 0.01 && cps <= 1000) || *end,
+			       "invalid scroll speed: %s", optarg);
+			D.scrollPeriod = NSEC_PER_SEC / cps;
+			break;
+		}
+
 			/* An argument */
 		case 1:
-			if (!hostarg) { hostarg = optarg; break; }
-			if (!portarg) { portarg = optarg; break; }
-			die_on(1, "invalid argument: %s", optarg);
+			D.servers[D.count++].host = optarg;
+			break;
 
 			/* An error */
 		default:
@@ -259,42 +375,41 @@ static void parseArguments(int argc, char **argv) {
 	}
 
 
-	/* Host, password and port */
-	if (!hostarg) {
-		hostarg = getenv("MPD_HOST");
-	}
-	if (!hostarg) {
-		hostarg = DEFAULT_HOST;
-	}
-	end = strchr(hostarg, '@');
-	if (end) {
-		/* If '@' has been found we got host from either command line
-		 * or environment and in both cases the string is
-		 * modifiable. */
-		*end = 0;
-		D.password = hostarg;
-		hostarg = end + 1;
-	}
-	D.host = hostarg;
-
-	if (!portarg) {
-		portarg = getenv("MPD_PORT");
+	/* Hosts, passwords and ports.  "<host> <port>" is still accepted
+	 * for backwards compatibility, otherwise each argument names
+	 * a separate server. */
+	if (D.count == 2 && D.servers[1].host[0] &&
+	    strspn(D.servers[1].host, "0123456789") ==
+	    strlen(D.servers[1].host)) {
+		portarg = D.servers[1].host;
+		D.count = 1;
 	}
-	if (!portarg) {
-		end = strchr(hostarg, ':');
-		if (end) {
-			*end = 0;
-			portarg = end + 1;
+	if (!D.count) {
+		D.servers->host = getenv("MPD_HOST");
+		if (!D.servers->host) {
+			D.servers->host = DEFAULT_HOST;
 		}
+		D.count = 1;
 	}
-	if (!portarg) {
-		D.port = DEFAULT_PORT;
-	} else {
-		unsigned long p = strtoul(portarg, &end, 0);
-		die_on(p <= 0 || p > 0xffff || *end, "invalid port: %s", portarg);
-		D.port = p;
+	for (i = 0; i < D.count; ++i) {
+		/* The host comes from either command line, environment or
+		 * DEFAULT_HOST.  The first two are modifiable and the last
+		 * contains neither '@' nor ':' so parseServer() won't try
+		 * to modify it. */
+		parseServer(D.servers + i, (char *)D.servers[i].host, portarg);
 	}
 
+	/* One more for the sharing socket, see sleepUntil() */
+	D.pollfds = malloc((D.count + 1) * sizeof *D.pollfds);
+	pdie_on(!D.pollfds, "malloc");
+
+
+	/* Sharing */
+	die_on(D.publishPath && D.followPath, "-P and -F are mutually exclusive");
+	if (D.publishPath) {
+		D.output = OUTPUT_PUBLISH;
+	}
+	D.shareFd = -1;
 
 	/* Format */
 	D.format = wideFromMulti(format);
@@ -302,24 +417,63 @@ static void parseArguments(int argc, char **argv) {
 
 	/* Columns */
 #if HAVE_RESIZE
-	if (!D.cur.columns) {
+	if (!columns) {
 		handleResize(SIGWINCH);
-		D.cur.columns = D.width;
+		columns = D.width;
 	}
 #endif
-	if (!D.cur.columns) {
+	if (!columns) {
 		end = getenv("COLUMNS");
 		if (end) {
 			unsigned long c = strtoul(end, &end, 0);
 			if (c >= 3 && c <= UINT_MAX && !*end) {
-				D.cur.columns = c;
+				columns = c;
 			}
 		}
 	}
-	if (!D.cur.columns) {
-		D.cur.columns = DEFAULT_COLUMNS;
+	if (!columns) {
+		columns = DEFAULT_COLUMNS;
+	}
+	D.width = columns;
+}
+
+
+static void parseServer(struct server *srv, char *hostarg, const char *portarg) {
+	char *end;
+
+	end = strchr(hostarg, '@');
+	if (end) {
+		*end = 0;
+		srv->password = hostarg;
+		hostarg = end + 1;
+	}
+	srv->host = hostarg;
+
+	/* <port> argument, then <host>:<port>, then $MPD_PORT.  A port
+	 * in <host> used to lose to $MPD_PORT but with several hosts
+	 * each needs its own. */
+	end = strchr(hostarg, ':');
+	if (end) {
+		*end = 0;
+		if (!portarg) {
+			portarg = end + 1;
+		}
+	}
+	if (!portarg) {
+		portarg = getenv("MPD_PORT");
+	}
+	if (!portarg) {
+		srv->port = DEFAULT_PORT;
+	} else {
+		unsigned long p = strtoul(portarg, &end, 0);
+		die_on(p <= 0 || p > 0xffff || *end, "invalid port: %s", portarg);
+		srv->port = p;
 	}
-	D.width = D.cur.columns;
+
+	srv->cur.songid = -1;
+	srv->old.songid = -1;
+	srv->backoff = 1;
+	srv->fresh = 1;
 }
 
 
@@ -373,121 +527,536 @@ static void handleResize(int sig) {
 #endif
 
 
+/******************** Timing ************************************************/
+static uint64_t timeNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t nextDeadline(uint64_t deadline, uint64_t period, uint64_t now) {
+	/* Keep the phase but skip ticks we were too busy to handle. */
+	return now < deadline + period
+		? deadline + period
+		: now + period - (now - deadline) % period;
+}
+
+static uint64_t nextWakeup(uint64_t pollAt, uint64_t scrollAt) {
+	uint64_t wakeAt = pollAt;
+	unsigned i;
+
+	if (D.scrolling && scrollAt < wakeAt) {
+		wakeAt = scrollAt;
+	}
+	if (D.followPath) {
+		if (D.shareFd < 0 && D.followReconnectAt < wakeAt) {
+			wakeAt = D.followReconnectAt;
+		}
+		return wakeAt;
+	}
+	for (i = 0; i < D.count; ++i) {
+		const struct server *const srv = D.servers + i;
+		if (srv->connecting || srv->waiting) {
+			if (srv->timeoutAt < wakeAt) {
+				wakeAt = srv->timeoutAt;
+			}
+		} else if (!srv->connected && srv->reconnectAt < wakeAt) {
+			wakeAt = srv->reconnectAt;
+		}
+	}
+	return wakeAt;
+}
+
+static unsigned setPollFds(void) {
+	unsigned i, n = 0;
+
+	for (i = 0; i < D.count; ++i) {
+		const struct server *const srv = D.servers + i;
+		D.pollfds[i].fd = srv->connecting || srv->waiting
+			? srv->conn->sock : -1;
+		D.pollfds[i].events = POLLIN;
+		n += D.pollfds[i].fd >= 0;
+	}
+	return n;
+}
+
+static void sleepUntil(uint64_t deadline) {
+	struct pollfd *const fds = D.pollfds;
+	struct timespec ts;
+
+	/* Wake up as soon as a server greets us or answers a query or,
+	 * when publishing or following, as soon as a follower connects
+	 * or the leader sends something.  Negative descriptors are
+	 * ignored by poll(2). */
+	fds[D.count].fd = D.shareFd;
+	fds[D.count].events = POLLIN;
+	if (setPollFds() || D.shareFd >= 0) {
+		uint64_t now = timeNow();
+		if (deadline > now) {
+			poll(fds, D.count + 1, (deadline - now + 999999) / 1000000);
+		}
+		return;
+	}
+
+	ts.tv_sec  = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+	/* If interrupted by a signal, main loop will check done() and
+	 * simply come back here if nothing is due. */
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+}
+
+
+/******************** Polling servers ***************************************/
+static void followLeader(uint64_t now);
+static void acceptFollowers(void);
+
+static void pollServers(int query, uint64_t now) {
+	struct pollfd *const fds = D.pollfds;
+	unsigned i;
+	int ready = 0;
+
+	if (D.followPath) {
+		followLeader(now);
+		return;
+	}
+	if (D.publishPath) {
+		acceptFollowers();
+	}
+
+	/* Nothing here blocks on a server which has not sent anything
+	 * yet so one which hangs cannot hold up the others.  Handle
+	 * greetings and replies which have arrived (sleepUntil() wakes
+	 * us up for those) and give up on servers which are late. */
+	if (setPollFds()) {
+		ready = poll(fds, D.count, 0) > 0;
+	}
+	for (i = 0; i < D.count; ++i) {
+		S = D.servers + i;
+		if (fds[i].fd < 0) {
+			continue;
+		}
+
+		if (ready && fds[i].revents) {
+			if (S->connecting) {
+				readGreeting(now);
+			} else {
+				readReply(now);
+			}
+		}
+
+		if ((S->connecting || S->waiting) && now >= S->timeoutAt) {
+			failConnection(S->connecting
+			               ? MPD_ERROR_NORESPONSE : MPD_ERROR_TIMEOUT,
+			               "timeout in attempting to get a response"
+			               " from \"%s\" on port %u",
+			               S->host, S->port);
+		}
+	}
+
+	/* Only settled servers have a state worth showing; until then
+	 * the last one stays.  This is done before reconnecting so that
+	 * a failure is shown until the next attempt settles. */
+	for (i = 0; i < D.count; ++i) {
+		S = D.servers + i;
+		if (S->conn && !S->connecting && !S->waiting) {
+			S->cur.error = S->conn->error;
+			strcpy(S->error, S->conn->errorStr);
+			S->errorStr  = S->error;
+		}
+	}
+
+	/* (Re)connect servers whose back-off has expired and, if it's
+	 * time to, send status queries to all connected ones so they are
+	 * all being answered at the same time.  A server still busy with
+	 * the previous query is not sent another one. */
+	for (i = 0; i < D.count; ++i) {
+		S = D.servers + i;
+		if (S->connecting || S->waiting) {
+			continue;
+		} else if (!S->connected) {
+			if (now >= S->reconnectAt) {
+				S->backoff = S->backoff <= 30 ? S->backoff * 2 : 60;
+				S->reconnectAt = now + S->backoff * NSEC_PER_SEC;
+				connectToMPD(S->backoff > 10 ? 10 : S->backoff, now);
+			}
+		} else if (query) {
+			sendQuery(now);
+		}
+	}
+}
+
+
 /******************** Connection handling ***********************************/
-static int  connectToMPD(unsigned timeout) {
+static void connectToMPD(unsigned timeout, uint64_t now) {
+	struct addrinfo hints, *res, *ai;
+	mpd_Connection *conn;
+	char service[8];
+	int ret, sock = -1;
+
+	/* What libmpdclient's mpd_newConnection() does, except that
+	 * the greeting is read by readGreeting() once it arrives. */
+	conn = malloc(sizeof *conn);
+	pdie_on(!conn, "malloc");
+	memset(conn, 0, sizeof *conn);
+	conn->sock = -1;
+	mpd_setConnectionTimeout(conn, timeout);
+
 	disconnectFromMPD();
+	S->conn = conn;
+	S->connecting = 1;
+	S->timeoutAt = now + timeout * NSEC_PER_SEC;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_flags    = AI_ADDRCONFIG;
+	hints.ai_family   = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	sprintf(service, "%u", S->port);
+
+	ret = getaddrinfo(S->host, service, &hints, &res);
+	if (ret) {
+		failConnection(MPD_ERROR_UNKHOST, "host \"%s\" not found: %s",
+		               S->host, gai_strerror(ret));
+		return;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, SOCK_STREAM, ai->ai_protocol);
+		if (sock < 0) {
+			break;
+		}
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+		if (!connect(sock, ai->ai_addr, ai->ai_addrlen) ||
+		    errno == EINPROGRESS) {
+			break;
+		}
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+
+	if (sock < 0) {
+		failConnection(MPD_ERROR_CONNPORT,
+		               "problems connecting to \"%s\" on port %u: %s",
+		               S->host, S->port, strerror(errno));
+		return;
+	}
+	conn->sock = sock;
+}
 
-	D.conn = mpd_newConnection(D.host, D.port, timeout);
-	pdie_on(!D.conn, "connect");
+static void readGreeting(uint64_t now) {
+	mpd_Connection *const conn = S->conn;
+	const size_t len = sizeof MPD_WELCOME_MESSAGE - 1;
+	socklen_t optlen = sizeof(int);
+	char *nl, *end;
+	ssize_t ret;
+	int i;
+
+	/* A failed connect(2) also wakes us up. */
+	if (!getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &i, &optlen) && i) {
+		failConnection(MPD_ERROR_CONNPORT,
+		               "problems connecting to \"%s\" on port %u: %s",
+		               S->host, S->port, strerror(i));
+		return;
+	}
 
-	if (D.password && !error()) {
-		mpd_sendPasswordCommand(D.conn, D.password);
-		if (!error()) {
-			mpd_finishCommand(D.conn);
+	ret = recv(conn->sock, conn->buffer + conn->buflen,
+	           MPD_BUFFER_MAX_LENGTH - conn->buflen, 0);
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	} else if (ret <= 0) {
+		failConnection(MPD_ERROR_NORESPONSE,
+		               "problems getting a response from \"%s\""
+		               " on port %u: %s", S->host, S->port,
+		               ret ? strerror(errno) : "connection closed");
+		return;
+	}
+	conn->buflen += ret;
+	conn->buffer[conn->buflen] = 0;
+
+	nl = strchr(conn->buffer, '\n');
+	if (!nl && conn->buflen < MPD_BUFFER_MAX_LENGTH) {
+		return;
+	} else if (!nl || strncmp(conn->buffer, MPD_WELCOME_MESSAGE, len)) {
+		failConnection(MPD_ERROR_NOTMPD,
+		               "mpd not running on port %u on host \"%s\"",
+		               S->port, S->host);
+		return;
+	}
+
+	*nl = 0;
+	end = conn->buffer + len;
+	for (i = 0; i < 3; ++i) {
+		conn->version[i] = strtol(end, &end, 10);
+		if (*end != '.' && *end) {
+			failConnection(MPD_ERROR_NOTMPD,
+			               "error parsing version number at \"%s\"",
+			               conn->buffer + len);
+			return;
 		}
+		end += !!*end;
+	}
+
+	conn->buflen -= nl + 1 - conn->buffer;
+	memmove(conn->buffer, nl + 1, conn->buflen + 1);
+	conn->doneProcessing = 1;
+	S->connecting = 0;
+	S->backoff = 1;
+
+	if (S->password) {
+		mpd_sendPasswordCommand(conn, S->password);
+		awaitReply(WAIT_PASSWORD, now);
+	} else {
+		sendQuery(now);
 	}
+}
+
+static void failConnection(int code, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(S->conn->errorStr, sizeof S->conn->errorStr, fmt, ap);
+	va_end(ap);
+	S->conn->error = code;
 
-	return !error();
+	/* Close the socket now rather than on the next attempt so
+	 * a hung server does not keep it. */
+	if (S->conn->sock >= 0) {
+		close(S->conn->sock);
+		S->conn->sock = -1;
+	}
+	S->connected = S->connecting = 0;
+	S->waiting = WAIT_NONE;
 }
 
 static void disconnectFromMPD(void) {
-	if (D.conn) {
-		mpd_closeConnection(D.conn);
-		D.conn = 0;
+	if (S->conn) {
+		mpd_closeConnection(S->conn);
+		S->conn = 0;
+	}
+	if (S->info) {
+		mpd_freeInfoEntity(S->info);
+		S->info = 0;
 	}
-	if (D.info) {
-		mpd_freeInfoEntity(D.info);
-		D.info = 0;
+	S->connected = S->connecting = 0;
+	S->waiting = WAIT_NONE;
+	S->cur.songid = -1;
+	S->old.songid = -1;
+}
+
+static void disconnectAll(void) {
+	unsigned i;
+	for (i = 0; i < D.count; ++i) {
+		S = D.servers + i;
+		disconnectFromMPD();
 	}
-	D.cur.songid = -1;
-	D.old.songid = -1;
 }
 
 
 /******************** Song ingo retrival ************************************/
-static int  getSong(void) {
-	mpd_Status *status;
-	mpd_InfoEntity *info;
+static void sendQuery(uint64_t now) {
+	mpd_sendStatusCommand(S->conn);
+	awaitReply(WAIT_STATUS, now);
+}
 
-	/* Get status */
-	mpd_sendStatusCommand(D.conn);
-	if (error()) return 0;
-	status = mpd_getStatus(D.conn);
-	if (error()) return 0;
-	pdie_on(!status, "get status");
+static void awaitReply(int what, uint64_t now) {
+	S->connected = !error();
+	S->waiting = S->connected ? what : WAIT_NONE;
+	S->timeoutAt = now + S->conn->timeout.tv_sec * NSEC_PER_SEC;
+}
 
-	mpd_nextListOkCommand(D.conn);
-	if (error()) {
-		mpd_freeStatus(status);
-		return 0;
+/* Whether the buffer holds whole reply, i.e. its "OK" or "ACK" line. */
+static int  haveReply(const mpd_Connection *conn) {
+	const char *line = conn->buffer + conn->bufstart, *nl;
+
+	for (; (nl = strchr(line, '\n')); line = nl + 1) {
+		if (!strncmp(line, "OK\n", 3) || !strncmp(line, "ACK ", 4)) {
+			return 1;
+		}
 	}
+	return 0;
+}
 
-	/* Copy status */
-	D.cur.state  = status->state;
-	D.cur.songid = status->songid;
-	D.cur.pos    = status->elapsedTime;
-	D.cur.len    = status->totalTime;
-	mpd_freeStatus(status);
+static void readReply(uint64_t now) {
+	mpd_Connection *const conn = S->conn;
+	ssize_t ret;
 
-	/* Same song, return */
-	if (D.cur.songid == D.old.songid) {
-		return 1;
+	conn->buflen -= conn->bufstart;
+	memmove(conn->buffer, conn->buffer + conn->bufstart, conn->buflen + 1);
+	conn->bufstart = 0;
+
+	ret = recv(conn->sock, conn->buffer + conn->buflen,
+	           MPD_BUFFER_MAX_LENGTH - conn->buflen, 0);
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	} else if (ret <= 0) {
+		failConnection(MPD_ERROR_CONNCLOSED, "connection closed");
+		return;
+	}
+	conn->buflen += ret;
+	conn->buffer[conn->buflen] = 0;
+
+	/* Only once the whole reply is here libmpdclient is let to parse
+	 * it so it never has to wait for the server. */
+	if (!haveReply(conn)) {
+		if (conn->buflen == MPD_BUFFER_MAX_LENGTH) {
+			failConnection(MPD_ERROR_BUFFEROVERRUN, "buffer overrun");
+		}
+		return;
 	}
 
-	if (D.info) {
-		mpd_freeInfoEntity(D.info);
-		D.info = 0;
+	switch (S->waiting) {
+	case WAIT_PASSWORD:
+		mpd_finishCommand(conn);
+		if (!error()) {
+			sendQuery(now);
+			return;
+		}
+		S->connected = 0;
+		break;
+
+	case WAIT_STATUS:
+		if (gotStatus()) {
+			mpd_sendCurrentSongCommand(conn);
+			awaitReply(WAIT_SONG, now);
+			return;
+		}
+		break;
+
+	case WAIT_SONG:
+		gotSong();
+		break;
+
+	case WAIT_NONE:
+		break;
 	}
+	S->waiting = WAIT_NONE;
+}
+
+/* Returns whether current song needs to be asked for. */
+static int  gotStatus(void) {
+	mpd_Status *status;
 
-	/* Get song */
-	mpd_sendCurrentSongCommand(D.conn);
+	/* The command has been sent by sendQuery() */
+	status = mpd_getStatus(S->conn);
 	if (error()) {
+		S->connected = 0;
 		return 0;
 	}
-	info = mpd_getNextInfoEntity(D.conn);
+	pdie_on(!status, "get status");
+
+	mpd_nextListOkCommand(S->conn);
 	if (error()) {
+		mpd_freeStatus(status);
+		S->connected = 0;
 		return 0;
 	}
 
-	if (!info) {
-		return
-			D.cur.state == MPD_STATUS_STATE_PLAY ||
-			D.cur.state == MPD_STATUS_STATE_PAUSE;
-	}
+	/* Copy status */
+	S->cur.state  = status->state;
+	S->cur.songid = status->songid;
+	S->cur.pos    = status->elapsedTime;
+	S->cur.len    = status->totalTime;
+	mpd_freeStatus(status);
 
-	if (info->type != MPD_INFO_ENTITY_TYPE_SONG) {
-		mpd_freeInfoEntity(info);
+	/* Same song, return */
+	if (S->cur.songid == S->old.songid) {
 		return 0;
 	}
 
-	D.info = info;
+	if (S->info) {
+		mpd_freeInfoEntity(S->info);
+		S->info = 0;
+	}
 	return 1;
 }
 
+static void gotSong(void) {
+	mpd_InfoEntity *info;
+
+	info = mpd_getNextInfoEntity(S->conn);
+	if (error()) {
+		S->connected = 0;
+	} else if (!info) {
+		S->connected =
+			S->cur.state == MPD_STATUS_STATE_PLAY ||
+			S->cur.state == MPD_STATUS_STATE_PAUSE;
+	} else if (info->type != MPD_INFO_ENTITY_TYPE_SONG) {
+		mpd_freeInfoEntity(info);
+		S->connected = 0;
+	} else {
+		S->info = info;
+	}
+}
+
 
 /******************** Displaying data ***************************************/
+static const wchar_t separator[7] = L" * * * ";
+static const size_t separator_len = sizeof separator / sizeof *separator;
+
 static void formatLine(void);
 static void calculateHilightPos(void);
 static void output(void);
+static void outputRecord(void);
+static void publishRecord(void);
 
 
-static void display(unsigned secs) {
-	static int first_time = 1;
+static int  isScrolled(void) {
+	return S->cur.columns > 2 && S->line_len >= S->cur.columns - 2;
+}
 
-	do {
+static void scrollLines(void) {
+	unsigned i;
+
+	for (i = 0; i < D.count; ++i) {
+		S = D.servers + i;
+		S->cur.scroll = isScrolled()
+			? (S->cur.scroll + 1) % (S->line_len + separator_len)
+			: 0;
+	}
+}
+
+
+static void display(void) {
+	int scrolling = 0;
+	unsigned i;
+
+	for (i = 0; i < D.count; ++i) {
 		int doDisplay = 0;
 
-		D.cur.error   = D.conn->error;
-		D.cur.columns = D.width;
+		S = D.servers + i;
+		S->cur.columns = D.width;
 
-#define CHANGED(field) (D.cur.field != D.old.field)
+		/* Nothing to show before the first reply or failure. */
+		if (S->fresh && !S->cur.error &&
+		    (S->connecting || S->waiting)) {
+			continue;
+		}
+
+#define CHANGED(field) (S->cur.field != S->old.field)
 
-		if (first_time || CHANGED(error) || CHANGED(songid)) {
-			first_time = 0;
+		if (S->fresh || CHANGED(error) || CHANGED(songid)) {
+			S->fresh = 0;
 			formatLine();
 			doDisplay = 1;
 		}
 
+		/* Records carry no columns, progress bar nor scrolling so
+		 * only emit one when something they do carry changed. */
+		if (D.output != OUTPUT_TERM) {
+			doDisplay = doDisplay || CHANGED(state) ||
+				CHANGED(pos) || CHANGED(len);
+			S->old = S->cur;
+			if (!doDisplay) {
+				/* nop */
+			} else if (D.output == OUTPUT_PUBLISH) {
+				publishRecord();
+			} else {
+				outputRecord();
+			}
+			continue;
+		}
+
 		doDisplay = doDisplay || CHANGED(columns);
 		if (doDisplay || CHANGED(pos) || CHANGED(len)) {
 			calculateHilightPos();
@@ -498,20 +1067,22 @@ static void display(unsigned secs) {
 
 #undef CHANGED
 
-		D.old = D.cur;
+		S->old = S->cur;
 		if (doDisplay || D.background) {
 			output();
 		}
-		usleep(1000000);
-	} while (!done() && --secs);
+		scrolling = scrolling || isScrolled();
+	}
+
+	D.scrolling = scrolling;
 }
 
 
 
 static void calculateHilightPos(void) {
-	if (!D.cur.error) {
-		D.cur.hilightPos = D.cur.len
-			? (wchar_t)D.cur.pos * D.cur.columns / D.cur.len
+	if (!S->cur.error) {
+		S->cur.hilightPos = S->cur.len
+			? (wchar_t)S->cur.pos * S->cur.columns / S->cur.len
 			: (unsigned)0;
 	}
 }
@@ -526,18 +1097,18 @@ static void outputScrolled(unsigned cols);
 
 
 static void output(void) {
-	unsigned cols = D.cur.columns;
+	unsigned cols = S->cur.columns;
 	wchar_t tmp;
 
-	hilightLeft = D.cur.error ? 0 : D.cur.hilightPos;
+	hilightLeft = S->cur.error ? 0 : S->cur.hilightPos;
 
 	termBeginLine();
 
 	/* State */
-	if (D.cur.error) {
+	if (S->cur.error) {
 		tmp = '!';
 	} else {
-		switch (D.cur.state) {
+		switch (S->cur.state) {
 		case MPD_STATUS_STATE_STOP:  tmp = L'\u25A0'; break;
 		case MPD_STATUS_STATE_PLAY:  tmp = L'\u25BA'; break;
 		case MPD_STATUS_STATE_PAUSE: tmp = L' '; break;
@@ -554,8 +1125,8 @@ static void output(void) {
 		goto end;
 	}
 
-	if (D.line_len < cols) {
-		outs(D.line, D.line_len);
+	if (S->line_len < cols) {
+		outs(S->line, S->line_len);
 	} else {
 		outputScrolled(cols);
 	}
@@ -571,25 +1142,21 @@ end:
 
 
 static void outputScrolled(unsigned cols) {
-	static const wchar_t separator[7] = L" * * * ";
-	static const size_t separator_len =
-		sizeof separator / sizeof *separator;
-
-	const size_t scroll = D.cur.scroll;
+	const size_t scroll = S->cur.scroll;
 
-	if (scroll < D.line_len) {
-		unsigned len = D.line_len - D.cur.scroll;
+	if (scroll < S->line_len) {
+		unsigned len = S->line_len - S->cur.scroll;
 		if (len >= cols) {
 			len = cols - 1;
 		}
-		outs(D.line + scroll, len);
+		outs(S->line + scroll, len);
 		cols -= len;
 	}
 
 	if (cols != 1) {
 		unsigned skip = 0, len = separator_len;
-		if (scroll > D.line_len) {
-			skip = D.cur.scroll - D.line_len;
+		if (scroll > S->line_len) {
+			skip = S->cur.scroll - S->line_len;
 			len -= skip;
 		}
 
@@ -602,11 +1169,9 @@ static void outputScrolled(unsigned cols) {
 	}
 
 	if (cols != 1) {
-		outs(D.line, cols - 1);
+		outs(S->line, cols - 1);
 		cols = 1;
 	}
-
-	D.cur.scroll = (scroll + 1) % (D.line_len + separator_len);
 }
 
 
@@ -628,6 +1193,520 @@ static void outs(const wchar_t *str, size_t len) {
 }
 
 
+/******************** Outputting records ************************************/
+static void outsRecord(const wchar_t *str, size_t len) __attribute__((nonnull));
+
+static void outputRecord(void) {
+	static const char *const states[] = {
+		"unknown", "stop", "play", "pause"
+	};
+	const char *state = S->cur.error ? "error"
+		: (unsigned)S->cur.state < sizeof states / sizeof *states
+		? states[S->cur.state] : "unknown";
+	const wchar_t *text = S->line;
+	size_t len = S->line_len;
+
+	/* Error message is formatted as "[message]", drop the brackets. */
+	if (S->cur.error && len >= 2) {
+		++text;
+		len -= 2;
+	}
+
+	if (D.output == OUTPUT_JSON) {
+		printf("{\"server\":\"%s:%u\",\"state\":\"%s\","
+		       "\"elapsed\":%d,\"total\":%d,\"%s\":\"",
+		       S->host, (unsigned)S->port, state, S->cur.pos, S->cur.len,
+		       S->cur.error ? "error" : "song");
+		outsRecord(text, len);
+		puts("\"}");
+	} else {
+		printf("%s:%u\t%s\t%d\t%d\t", S->host, (unsigned)S->port,
+		       state, S->cur.pos, S->cur.len);
+		outsRecord(text, len);
+		putchar('\n');
+	}
+
+	fflush(stdout);
+}
+
+static void outsRecord(const wchar_t *str, size_t len) {
+	const wchar_t *start = str;
+
+	for (; len; --len, ++str) {
+		if (*str >= 0x20 && (D.output != OUTPUT_JSON ||
+		                     (*str != L'"' && *str != L'\\'))) {
+			continue;
+		}
+
+		if (str != start) {
+			_outs(start, str - start);
+		}
+		start = str + 1;
+
+		/* Control characters would break the record, in plain
+		 * format replace them with spaces, in JSON escape them. */
+		if (D.output != OUTPUT_JSON) {
+			putchar(' ');
+		} else if (*str >= 0x20) {
+			printf("\\%c", (char)*str);
+		} else {
+			printf("\\u%04x", (unsigned)*str);
+		}
+	}
+
+	if (str != start) {
+		_outs(start, str - start);
+	}
+}
+
+
+/******************** Sharing state *****************************************/
+/*
+ * A publishing instance (-P) talks to MPD and sends state of each
+ * server to all instances following it (-F) over a Unix socket so
+ * that MPD sees a single client no matter how many are displaying.
+ * Upon connecting, a follower gets a "servers: <count>" line followed
+ * by records of all servers.  After that a record is sent whenever
+ * state of a server changes.  A record looks as follows:
+ *
+ *   server: <index>
+ *   host: <host>
+ *   port: <port>
+ *   error: <MPD_ERROR_* or zero>
+ *   message: <error message>       (only if error is non-zero)
+ *   state: <MPD_STATUS_STATE_*>
+ *   songid: <id>
+ *   elapsed: <seconds>
+ *   total: <seconds>
+ *   <tag>: <value>                 (for each tag the song has)
+ *   end
+ */
+
+static const struct {
+	const char *name;
+	size_t offset;
+} songTags[] = {
+	{ "file",     offsetof(mpd_Song, file)     },
+	{ "Artist",   offsetof(mpd_Song, artist)   },
+	{ "Title",    offsetof(mpd_Song, title)    },
+	{ "Album",    offsetof(mpd_Song, album)    },
+	{ "Track",    offsetof(mpd_Song, track)    },
+	{ "Name",     offsetof(mpd_Song, name)     },
+	{ "Date",     offsetof(mpd_Song, date)     },
+	{ "Genre",    offsetof(mpd_Song, genre)    },
+	{ "Composer", offsetof(mpd_Song, composer) },
+	{ "Disc",     offsetof(mpd_Song, disc)     },
+	{ "Comment",  offsetof(mpd_Song, comment)  },
+};
+
+#define songTag(song, i) (*(char **)((char *)(song) + songTags[i].offset))
+
+struct cbuffer {
+	size_t len;
+	size_t capacity;
+	char *buf;
+};
+
+static void cbufferReserve(struct cbuffer *cb, size_t len) {
+	size_t cap = cb->capacity ? cb->capacity : 256;
+
+	if (cb->len + len <= cb->capacity) {
+		return;
+	}
+
+	while (cap < cb->len + len) {
+		cap *= 2;
+	}
+	cb->buf = realloc(cb->buf, cap);
+	pdie_on(!cb->buf, "malloc");
+	cb->capacity = cap;
+}
+
+static void cbufferPrintf(struct cbuffer *cb, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3), nonnull));
+static void cbufferPrintf(struct cbuffer *cb, const char *fmt, ...) {
+	va_list ap;
+	int ret;
+
+	cbufferReserve(cb, 64);
+	for (;;) {
+		va_start(ap, fmt);
+		ret = vsnprintf(cb->buf + cb->len, cb->capacity - cb->len, fmt, ap);
+		va_end(ap);
+		pdie_on(ret < 0, "vsnprintf");
+		if ((size_t)ret < cb->capacity - cb->len) {
+			break;
+		}
+		cbufferReserve(cb, ret + 1);
+	}
+	cb->len += ret;
+}
+
+
+/********** Publishing **********/
+static void unlinkSocket(void) {
+	unlink(D.shareAddr.sun_path);
+}
+
+static void followInit(void);
+
+static void shareInit(void) {
+	const char *const path = D.publishPath ? D.publishPath : D.followPath;
+	struct sockaddr *const addr = (struct sockaddr *)&D.shareAddr;
+	int fd;
+
+	if (!path) {
+		return;
+	}
+
+	die_on(strlen(path) >= sizeof D.shareAddr.sun_path,
+	       "socket path too long: %s", path);
+	D.shareAddr.sun_family = AF_UNIX;
+	strcpy(D.shareAddr.sun_path, path);
+
+	if (D.followPath) {
+		followInit();
+		return;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	pdie_on(fd < 0, "socket");
+	if (bind(fd, addr, sizeof D.shareAddr) < 0) {
+		/* Maybe a socket left by an instance no longer running. */
+		int probe;
+		pdie_on(errno != EADDRINUSE, "bind: %s", path);
+		probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		pdie_on(probe < 0, "socket");
+		die_on(!connect(probe, addr, sizeof D.shareAddr),
+		       "%s: already published by another instance", path);
+		close(probe);
+		unlink(path);
+		pdie_on(bind(fd, addr, sizeof D.shareAddr) < 0, "bind: %s", path);
+	}
+	atexit(unlinkSocket);
+
+	pdie_on(listen(fd, 16) < 0, "listen: %s", path);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	D.shareFd = fd;
+}
+
+
+static void formatRecord(struct cbuffer *cb) {
+	const mpd_Song *const song = S->info ? S->info->info.song : 0;
+	size_t i;
+
+	cbufferPrintf(cb, "server: %u\nhost: %s\nport: %u\nerror: %d\n",
+	              (unsigned)(S - D.servers), S->host, (unsigned)S->port,
+	              S->cur.error);
+	if (S->cur.error) {
+		cbufferPrintf(cb, "message: %s\n", S->errorStr);
+	}
+	cbufferPrintf(cb, "state: %d\nsongid: %d\nelapsed: %d\ntotal: %d\n",
+	              S->cur.state, S->cur.songid, S->cur.pos, S->cur.len);
+
+	if (song) {
+		for (i = 0; i < sizeof songTags / sizeof *songTags; ++i) {
+			if (songTag(song, i)) {
+				cbufferPrintf(cb, "%s: %s\n", songTags[i].name,
+				              songTag(song, i));
+			}
+		}
+		if (song->time != MPD_SONG_NO_TIME) {
+			cbufferPrintf(cb, "Time: %d\n", song->time);
+		}
+	}
+
+	cbufferPrintf(cb, "end\n");
+}
+
+
+/* Sends data to the n-th follower dropping it on failure.  A follower
+ * which does not keep up (ie. its socket buffer is full) is dropped as
+ * well; it will simply reconnect and get full state again. */
+static int  sendFollower(unsigned n, const struct cbuffer *cb) {
+	const int fd = D.followers[n];
+
+	if (send(fd, cb->buf, cb->len, MSG_NOSIGNAL | MSG_DONTWAIT) ==
+	    (ssize_t)cb->len) {
+		return 1;
+	}
+
+	close(fd);
+	D.followers[n] = D.followers[--D.followersCount];
+	return 0;
+}
+
+static void acceptFollowers(void) {
+	static struct cbuffer cb;
+	unsigned i;
+	int fd;
+
+	while ((fd = accept(D.shareFd, 0, 0)) >= 0) {
+		D.followers = realloc(D.followers, (D.followersCount + 1) *
+		                      sizeof *D.followers);
+		pdie_on(!D.followers, "malloc");
+		D.followers[D.followersCount++] = fd;
+
+		cb.len = 0;
+		cbufferPrintf(&cb, "servers: %u\n", D.count);
+		for (i = 0; i < D.count; ++i) {
+			S = D.servers + i;
+			formatRecord(&cb);
+		}
+		sendFollower(D.followersCount - 1, &cb);
+	}
+}
+
+static void publishRecord(void) {
+	static struct cbuffer cb;
+	unsigned i;
+
+	cb.len = 0;
+	formatRecord(&cb);
+	for (i = D.followersCount; i; ) {
+		sendFollower(--i, &cb);
+	}
+}
+
+
+/********** Following **********/
+static struct {
+	struct cbuffer in;
+	struct server *srv;
+	struct state state;
+	mpd_Song *song;
+	char *message;
+} incoming;
+
+static int  followConnect(void) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	pdie_on(fd < 0, "socket");
+	if (connect(fd, (struct sockaddr *)&D.shareAddr, sizeof D.shareAddr)) {
+		close(fd);
+		return 0;
+	}
+	D.shareFd = fd;
+	return 1;
+}
+
+static int  followRead(void);
+
+static void followInit(void) {
+	pdie_on(!followConnect(), "connect: %s", D.followPath);
+	D.followBackoff = 1;
+
+	/* Servers are going to be allocated once the leader tells us how
+	 * many there are. */
+	free(D.servers);
+	D.servers = 0;
+	D.count = 0;
+	do {
+		die_on(!followRead(), "%s: leader closed connection",
+		       D.followPath);
+	} while (!D.count);
+}
+
+static void followLost(void) {
+	unsigned i;
+
+	close(D.shareFd);
+	D.shareFd = -1;
+	incoming.in.len = 0;
+	incoming.srv = 0;
+
+	for (i = 0; i < D.count; ++i) {
+		D.servers[i].cur.error = MPD_ERROR_CONNCLOSED;
+		D.servers[i].errorStr  = "connection to leader lost";
+	}
+}
+
+static void followLeader(uint64_t now) {
+	struct pollfd pfd;
+
+	if (D.shareFd < 0) {
+		if (now < D.followReconnectAt) {
+			return;
+		}
+		D.followBackoff = D.followBackoff <= 30 ? D.followBackoff * 2 : 60;
+		D.followReconnectAt = now + D.followBackoff * NSEC_PER_SEC;
+		if (!followConnect()) {
+			return;
+		}
+		D.followBackoff = 1;
+	}
+
+	/* Read whatever has arrived without waiting for more. */
+	pfd.fd = D.shareFd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 0) > 0) {
+		if (!followRead()) {
+			followLost();
+			return;
+		}
+	}
+}
+
+static void followLine(char *line);
+
+static int  followRead(void) {
+	struct cbuffer *const in = &incoming.in;
+	char *start, *end, *nl;
+	ssize_t ret;
+
+	cbufferReserve(in, 4096);
+	ret = recv(D.shareFd, in->buf + in->len, in->capacity - in->len, 0);
+	if (ret < 0 && errno == EINTR) {
+		return 1;
+	} else if (ret <= 0) {
+		return 0;
+	}
+	in->len += ret;
+
+	start = in->buf;
+	end = in->buf + in->len;
+	while ((nl = memchr(start, '\n', end - start))) {
+		*nl = 0;
+		followLine(start);
+		start = nl + 1;
+	}
+
+	in->len = end - start;
+	memmove(in->buf, start, in->len);
+	return 1;
+}
+
+static void followCommit(void);
+
+static void followLine(char *line) {
+	char *value;
+	size_t i;
+
+	if (!strcmp(line, "end")) {
+		followCommit();
+		return;
+	}
+
+	value = strchr(line, ':');
+	if (!value || value[1] != ' ') {
+		return;
+	}
+	*value = 0;
+	value += 2;
+
+	if (!strcmp(line, "servers")) {
+		/* Number of lines has been fixed when we first connected. */
+		if (!D.count) {
+			unsigned long n = strtoul(value, 0, 10);
+			die_on(!n || n > 1024, "%s: invalid number of servers: %s",
+			       D.followPath, value);
+			D.servers = calloc(n, sizeof *D.servers);
+			pdie_on(!D.servers, "malloc");
+			for (i = 0; i < n; ++i) {
+				D.servers[i].cur.songid = -1;
+				D.servers[i].old.songid = -1;
+				D.servers[i].errorStr = "";
+				D.servers[i].fresh = 1;
+			}
+			/* Was sized for the servers from the command line;
+			 * see parseArguments(). */
+			D.pollfds = realloc(D.pollfds,
+			                    (n + 1) * sizeof *D.pollfds);
+			pdie_on(!D.pollfds, "malloc");
+			D.count = n;
+		}
+		return;
+	}
+
+	if (!strcmp(line, "server")) {
+		unsigned long n = strtoul(value, 0, 10);
+		incoming.srv = n < D.count ? D.servers + n : 0;
+		memset(&incoming.state, 0, sizeof incoming.state);
+		incoming.state.songid = -1;
+		if (incoming.song) {
+			mpd_freeSong(incoming.song);
+			incoming.song = 0;
+		}
+		free(incoming.message);
+		incoming.message = 0;
+		return;
+	}
+
+	if (!incoming.srv) {
+		/* nop */
+	} else if (!strcmp(line, "host")) {
+		if (!incoming.srv->host) {
+			incoming.srv->host = strdup(value);
+			pdie_on(!incoming.srv->host, "malloc");
+		}
+	} else if (!strcmp(line, "port")) {
+		incoming.srv->port = atoi(value);
+	} else if (!strcmp(line, "error")) {
+		incoming.state.error = atoi(value);
+	} else if (!strcmp(line, "message")) {
+		free(incoming.message);
+		incoming.message = strdup(value);
+		pdie_on(!incoming.message, "malloc");
+	} else if (!strcmp(line, "state")) {
+		incoming.state.state = atoi(value);
+	} else if (!strcmp(line, "songid")) {
+		incoming.state.songid = atoi(value);
+	} else if (!strcmp(line, "elapsed")) {
+		incoming.state.pos = atoi(value);
+	} else if (!strcmp(line, "total")) {
+		incoming.state.len = atoi(value);
+	} else {
+		if (!incoming.song) {
+			incoming.song = mpd_newSong();
+			pdie_on(!incoming.song, "malloc");
+		}
+		if (!strcmp(line, "Time")) {
+			incoming.song->time = atoi(value);
+			return;
+		}
+		for (i = 0; i < sizeof songTags / sizeof *songTags; ++i) {
+			if (!strcmp(line, songTags[i].name)) {
+				free(songTag(incoming.song, i));
+				songTag(incoming.song, i) = strdup(value);
+				pdie_on(!songTag(incoming.song, i), "malloc");
+				break;
+			}
+		}
+	}
+}
+
+static void followCommit(void) {
+	struct server *const srv = incoming.srv;
+
+	if (!srv) {
+		return;
+	}
+	incoming.srv = 0;
+
+	srv->cur.error  = incoming.state.error;
+	srv->cur.state  = incoming.state.state;
+	srv->cur.songid = incoming.state.songid;
+	srv->cur.pos    = incoming.state.pos;
+	srv->cur.len    = incoming.state.len;
+
+	free(srv->message);
+	srv->message  = incoming.message;
+	srv->errorStr = srv->message ? srv->message : "";
+	incoming.message = 0;
+
+	if (srv->info) {
+		mpd_freeInfoEntity(srv->info);
+		srv->info = 0;
+	}
+	if (incoming.song) {
+		srv->info = mpd_newInfoEntity();
+		pdie_on(!srv->info, "malloc");
+		srv->info->type = MPD_INFO_ENTITY_TYPE_SONG;
+		srv->info->info.song = incoming.song;
+		incoming.song = 0;
+	}
+}
+
+
 /******************** Formatting line ***************************************/
 static void ensureCapacity(size_t capacity);
 
@@ -643,13 +1722,14 @@ static size_t doFormat(const wchar_t *p, size_t offset, const wchar_t **last)
 
 
 static void formatLine(void) {
-	if (D.cur.error) {
+	S->cur.scroll = 0;
+	if (S->cur.error) {
 		appendW(0, L"[", 1);
-		D.line_len = appendW(appendUTFStr(1, D.conn->errorStr), L"]", 1);
-	} else if (!D.info) {
-		D.line_len = appendW(0, L"[no song]", 10);
+		S->line_len = appendW(appendUTFStr(1, S->errorStr), L"]", 1);
+	} else if (!S->info) {
+		S->line_len = appendW(0, L"[no song]", 10);
 	} else {
-		D.line_len = doFormat(D.format, 0, 0);
+		S->line_len = doFormat(D.format, 0, 0);
 	}
 }
 
@@ -705,7 +1785,7 @@ static const wchar_t *skipFormatting(const wchar_t *p) {
 
 
 static size_t doFormatTag(const wchar_t *p, size_t off, const wchar_t **last) {
-	const mpd_Song *const song = D.info->info.song;
+	const mpd_Song *const song = S->info->info.song;
 	const wchar_t *const name = p;
 	const char *value;
 	size_t len;
@@ -839,7 +1919,7 @@ static size_t doFormat(const wchar_t *p, size_t offset, const wchar_t **last) {
 
 static void ensureCapacity(size_t capacity)
 {
-	size_t c = D.line_capacity;
+	size_t c = S->line_capacity;
 
 	if (c >= capacity) {
 		return;
@@ -847,8 +1927,8 @@ static void ensureCapacity(size_t capacity)
 
 	/* Check for overflow */
 	die_on(capacity * (size_t)2 < capacity
-	    || capacity * sizeof *D.line < capacity
-	    || capacity * (size_t)2 * sizeof *D.line < capacity,
+	    || capacity * sizeof *S->line < capacity
+	    || capacity * (size_t)2 * sizeof *S->line < capacity,
 	       "requested too much memory: %zu", capacity);
 
 	if (!c) {
@@ -860,9 +1940,9 @@ static void ensureCapacity(size_t capacity)
 
 	/* Don't care about loosing track of memory if realloc(3) fails,
 	 * we're going to die anyways. */
-	D.line = realloc(D.line, c * sizeof *D.line);
-	pdie_on(!D.line, "malloc");
-	D.line_capacity = c;
+	S->line = realloc(S->line, c * sizeof *S->line);
+	pdie_on(!S->line, "malloc");
+	S->line_capacity = c;
 }
 
 
@@ -874,7 +1954,7 @@ static size_t appendUTFStr(size_t offset, const char *str) {
 static size_t appendW(size_t offset, const wchar_t *str, size_t len)
 {
 	ensureCapacity(offset + len);
-	memcpy(D.line + offset, str, len * sizeof *str);
+	memcpy(S->line + offset, str, len * sizeof *str);
 	return offset + len;
 }
 
@@ -890,23 +1970,41 @@ static void termDone(void) {
 }
 
 static void termInit(void) {
+	unsigned i;
+
+	if (D.output != OUTPUT_TERM) {
+		return;
+	}
+
 	atexit(termDone);
 	if (!D.background) {
 		/* Hide cursor */
 		fputs("\33[?25l", stdout);
+		/* Make room for one line per server; cursor stays in the
+		 * last one. */
+		for (i = 1; i < D.count; ++i) {
+			putchar('\n');
+		}
 	}
 }
 
+/* Number of lines between current server's line and the last one. */
+static unsigned termLinesBelow(void) {
+	return D.count - 1 - (unsigned)(S - D.servers);
+}
+
 static void termBeginLine(void) {
 	/* Begining of line */
 	if (D.background) {
-		fputs("\0337\33[1;1f\r", stdout);
+		printf("\0337\33[%u;1f\r", (unsigned)(S - D.servers) + 1);
+	} else if (termLinesBelow()) {
+		printf("\r\33[%uA", termLinesBelow());
 	} else {
 		putchar('\r');
 	}
 
 	/* Set color */
-	if (D.cur.error) {
+	if (S->cur.error) {
 		fputs("\33[30;1m", stdout);     /* dark grey */
 	} else if (hilightLeft) {
 		fputs("\33[37;1;44m", stdout);  /* hilighted */
@@ -926,6 +2024,8 @@ static void termEndLine(void) {
 	/* Get back to saved position */
 	if (D.background) {
 		fputs("\0338", stdout);
+	} else if (termLinesBelow()) {
+		printf("\33[%uB", termLinesBelow());
 	}
 
 	/* and flush */
@@ -1110,9 +2210,9 @@ static void _outs(const wchar_t *str, size_t len) {
 static void appendIconvFunc(const char *buffer, size_t len, void *_off) {
 	size_t *offsetp = _off;
 
-	len /= sizeof *D.line;
+	len /= sizeof *S->line;
 	ensureCapacity(*offsetp + len);
-	memcpy(D.line + *offsetp, buffer, len * sizeof *D.line);
+	memcpy(S->line + *offsetp, buffer, len * sizeof *S->line);
 	*offsetp += len;
 }
 
@@ -1134,7 +2234,7 @@ static size_t appendUTFFallback(size_t offset, const char *str, size_t len) {
 	wchar_t *out;
 
 	ensureCapacity(offset + len);
-	out = D.line + offset;
+	out = S->line + offset;
 
 	/* http://en.wikipedia.org/wiki/UTF-8#Description */
 	/* Invalid sequences are simply ignored. */
@@ -1170,7 +2270,7 @@ static size_t appendUTFFallback(size_t offset, const char *str, size_t len) {
 		}
 	}
 
-	return out - D.line;
+	return out - S->line;
 #else
 	/* We should never be here */
 	die_on(1, "internall error (%d)", __LINE__);
@@ -0,0 +1,90 @@
+#!/bin/sh
+##
+## Compares text and binary mpd-state formats
+##
+## This program is free software; you can redistribute it and/or modify
+## it under the terms of the GNU General Public License as published by
+## the Free Software Foundation; either version 3 of the License, or
+## (at your option) any later version.
+##
+## This program is distributed in the hope that it will be useful,
+## but WITHOUT ANY WARRANTY; without even the implied warranty of
+## MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+## GNU General Public License for more details.
+##
+## You should have received a copy of the GNU General Public License
+## along with this program; if not, see <http://www.gnu.org/licenses/>.
+##
+## This is part of Tiny Applications Collection
+##   -> http://tinyapps.sourceforge.net/
+##
+
+#
+# Usage: mpd-state-bench.sh [ <host>[:<port>] [ <entries> ... ] ]
+#
+# For each number of entries (10000 and 100000 by default) restores
+# a playlist that long on given MPD, dumps it and restores it again,
+# once in text and once in binary format, and prints how long each
+# step took.  Songs are taken from the current playlist (which must
+# not be empty) and repeated as necessary.  MPD's state is put back
+# as it was at the end.
+#
+
+set -eu
+
+
+state="$PWD/mpd-state"
+if ! [ -x "$state" ]; then
+	echo "Expected $state to be executable." >&2
+	exit 2
+fi
+
+host=${1-${MPD_HOST-localhost}}
+[ $# -eq 0 ] || shift
+[ $# -ne 0 ] || set -- 10000 100000
+
+temp=$(mktemp -d || exit 2)
+trap 'rm -r -- "$temp"' 0
+
+"$state" "$host" >"$temp/orig"
+if ! grep -q '^0:' "$temp/orig"; then
+	echo "Playlist is empty, no songs to build a state from." >&2
+	exit 2
+fi
+trap '"$state" -r "$host" <"$temp/orig" || :; rm -r -- "$temp"' 0
+
+
+# Prints how many milliseconds running "$@" took.
+ms() {
+	start=$(date +%s%N)
+	"$@"
+	end=$(date +%s%N)
+	echo $(( (end - start) / 1000000 ))
+}
+
+printf '%8s %6s %10s %10s %10s\n' entries format dump restore size
+for n in "$@"; do
+	awk -v n="$n" '
+		/^playlist_begin$/ { p = 1; next }
+		/^playlist_end$/   { p = 0; next }
+		p { sub(/^[0-9]*:/, ""); songs[c++] = $0; next }
+		!/^outputs_/ && !/^[0-9]*:[01]:/ { print }
+		END {
+			print "playlist_begin"
+			for (i = 0; i < n; ++i) print i ":" songs[i % c]
+			print "playlist_end"
+		}' "$temp/orig" >"$temp/seed"
+	"$state" -r "$host" <"$temp/seed"
+
+	for fmt in text binary; do
+		flag=
+		[ $fmt = text ] || flag=-b
+		# shellcheck disable=SC2086
+		dump=$(ms sh -c '"$1" $2 "$3" >"$4"' - \
+		          "$state" "$flag" "$host" "$temp/$fmt")
+		restore=$(ms sh -c '"$1" -r "$2" <"$3"' - \
+		             "$state" "$host" "$temp/$fmt")
+		printf '%8d %6s %8dms %8dms %10d\n' "$n" $fmt \
+		       "$dump" "$restore" "$(wc -c <"$temp/$fmt")"
+	done
+done
@@ -26,10 +26,19 @@
 
 #include "libmpdclient.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 static const char *program_name = 0;
@@ -42,13 +51,20 @@ static const char *program_name = 0;
 #define DEFAULT_PORT "6600"
 #define LINELENGTH   FILENAME_MAX+50
 
+#define BINARY_MAGIC     "\211MPS"
+#define BINARY_MAGIC_LEN 4
+#define BINARY_VERSION   2
+
 
 /********** Some global variables and stuff **********/
 static char opt_skip_state, opt_skip_playlist, opt_skip_outputs = 0,
-	opt_restore = 0, opt_add = 0;
+	opt_restore = 0, opt_add = 0, opt_binary = 0;
+static const char *opt_delta = 0, *opt_compact = 0;
 static mpd_Connection *conn = 0;
-static char *hostarg = 0;
+static char *hostarg = 0, **hostargs = 0;
 static const char *portarg = 0;
+static unsigned hostargs_count = 0;
+static FILE *out;
 
 
 /********** Functions declaration **********/
@@ -57,20 +73,46 @@ static void parse_args(int argc, char **argv);
 static void connect_to_mpd(void);
 static void print_error_and_exit(int exit_code);
 
+static mpd_Status *get_status(void);
 static void print_status(void);
+static void print_status_lines(const mpd_Status *status);
 static void print_playlist(void);
 static void print_outputs(void);
 static void restore(void);
+static void print_binary(void);
+static void restore_binary(void);
+static void write_delta(void);
+static void compact(void);
+static char *xstrdup(const char *str);
+static void *xrealloc(void *ptr, size_t size);
 
 
 
 /********** Main **********/
 int main(int argc, char **argv) {
+	out = stdout;
 	parse_args(argc, argv);
-	connect_to_mpd();
+
+	if (opt_compact) {
+		compact();
+		return 0;
+	}
 
 	if (opt_restore) {
 		restore();
+		return 0;
+	}
+
+	connect_to_mpd();
+
+	if (opt_delta) {
+		write_delta();
+		mpd_closeConnection(conn);
+		return 0;
+	}
+
+	if (opt_binary) {
+		print_binary();
 		mpd_closeConnection(conn);
 		return 0;
 	}
@@ -87,10 +129,11 @@ int main(int argc, char **argv) {
 /********** Usage information **********/
 static void usage(void) {
 	printf("mpd-state  0.12.1  (c) 2005 by Avuton Olrich & Michal Nazarewicz\n"
-	       "usage: %s [ -rasSpPoO ] [ <host> [ <port> ]]]\n"
+	       "usage: %s [ -rabsSpPoO ] [ -d <file> | -c <file> ] [ <host> [ <port> ]]]\n"
 	       " -r      restere the state read from stdin (default is to\n"
 	       "         print status to stdout)\n"
 	       " -a      add to the playlist (instead of replacing the playlist)\n"
+	       " -b      print state in binary format (restore detects it)\n"
 	       " -s      ommit state\n"
 	       " -S      ommit everything but state\n"
 	       " -p      ommit playlsit\n"
@@ -98,11 +141,16 @@ static void usage(void) {
 	       " -o      ommit outputs (useful if you are using old MPD)\n"
 	       " -O      ommit everything but outputs\n",
 	       program_name);
+	puts(  " -d <file> append to <file> only what changed since state saved in it\n"
+	       " -c <file> merge changes appended with -d into a single state");
 	/* be nice to C89 and make string no longer then 509 chars */
 	puts(  " <host>  hostname MPD is running; if not set MPD_HOST is used;\n"
-	       "         if that is also missing '" DEFAULT_HOST "' is assumed\n"
+	       "         if that is also missing '" DEFAULT_HOST "' is assumed;\n"
+	       "         may be given as [<password>@]<host>[:<port>]\n"
 	       " <port>  port MPD is listining; if not set MPD_PORT is used;\n"
 	       "         if that is also missing " DEFAULT_PORT " is assumed");
+	puts(  "With -r any number of hosts may be given, state is restored on\n"
+	       "all of them at once and a summary is printed at the end.");
 }
 
 
@@ -119,12 +167,19 @@ static void parse_args(int argc, char **argv) {
 		exit(0);
 	}
 
+	hostargs = malloc(argc * sizeof *hostargs);
+	if (!hostargs) {
+		ERR("%s", "out of memory");
+		exit(1);
+	}
+
 	opterr = 0;
-	while ((opt = getopt(argc, argv, "-hraspo"))!=-1) {
+	while ((opt = getopt(argc, argv, "-hrasSbpPoOd:c:"))!=-1) {
 		switch (opt) {
 		case 'h': usage(); exit(0);
 		case 'r': opt_restore = 1; break;
 		case 'a': opt_add = 1; break;
+		case 'b': opt_binary = 1; break;
 		case 's': opt_skip_state = 1; break;
 		case 'S': opt_skip_state = 0;
 		          opt_skip_playlist = opt_skip_outputs = 1; break;
@@ -134,26 +189,42 @@ static void parse_args(int argc, char **argv) {
 		case 'o': opt_skip_outputs = 1; break;
 		case 'O': opt_skip_outputs = 0;
 		          opt_skip_state = opt_skip_playlist = 1; break;
+		case 'd': opt_delta = optarg; break;
+		case 'c': opt_compact = optarg; break;
 
-		case 1:
-			if (!hostarg) { hostarg = optarg; break; }
-			if (!portarg) { portarg = optarg; break; }
-			ERR("invalid argument: %s", optarg);
-			exit(1);
+		case 1: hostargs[hostargs_count++] = optarg; break;
 
 		default:
 			ERR("invalid option: %c", optopt);
 			exit(1);
 		}
 	}
+
+	/* "<host> <port>" or any number of "<host>[:<port>]" */
+	if (hostargs_count == 2 && *hostargs[1] &&
+	    !hostargs[1][strspn(hostargs[1], "0123456789")]) {
+		portarg = hostargs[1];
+		hostargs_count = 1;
+	}
+	if (opt_binary && (opt_delta || opt_compact)) {
+		ERR("%s", "-b cannot be used with -d nor -c");
+		exit(1);
+	}
+	if (hostargs_count > 1 && !opt_restore) {
+		ERR("%s", "more than one host can be given only with -r");
+		exit(1);
+	}
+	if (hostargs_count) {
+		hostarg = hostargs[0];
+	}
 }
 
 
 
 /********** Connects to MPD **********/
 static void connect_to_mpd(void) {
-	const char *host, *password;
-	char *test;
+	const char *password;
+	char *host, *test;
 	long port;
 
 	/* Host and password */
@@ -176,6 +247,12 @@ static void connect_to_mpd(void) {
 		password = 0;
 	}
 
+	/* Port may be given as <host>:<port> */
+	if (!portarg && (test = strchr(host, ':')) && !strchr(test + 1, ':')) {
+		*test = 0;
+		portarg = test + 1;
+	}
+
 	/* Port */
 	if (!portarg && !(portarg = getenv("MPD_PORT"))) {
 		portarg = DEFAULT_PORT;
@@ -211,80 +288,1099 @@ static void connect_to_mpd(void) {
 
 
 
-/********** Restore state from stdin **********/
-static void restore(void) {
-	int state = 0, seconds = MPD_PLAY_AT_BEGINNING, songnum = 0;
-	char buffer[LINELENGTH], *word, *str;
+/********** Pipelined command lists **********/
+/*
+ * libmpdclient can have only a single command in flight and talks to
+ * a single server so restore talks MPD protocol over its own sockets,
+ * one non-blocking connection per target.  Input is parsed once and
+ * every command is queued to all targets.  Commands are grouped in
+ * command lists of at most BATCH_SIZE commands and up to BATCH_WINDOW
+ * of those may be awaiting acknowledgement on each target at a time.
+ * This keeps memory usage bounded on both sides while no server is
+ * left waiting for us; the slowest one limits how fast input is read.
+ * A failing command is reported and the rest of its batch, which MPD
+ * aborted, is sent again; a failing target is dropped and the rest
+ * carry on.
+ */
+#define BATCH_SIZE    256
+#define BATCH_WINDOW  4
+#define BATCH_TIMEOUT 10000
+
+struct target {
+	const char *name;
+	int fd, welcomed;
+	char *error;
+
+	char *out;
+	size_t out_start, out_len, out_capacity;
+
+	char in[LINELENGTH];
+	size_t in_len;
+
+	/* Ring of batches; the one at head + count is being built.  Batch
+	 * of size zero is the password command.  Text of the commands is
+	 * kept so those after a failing one can be sent again. */
+	unsigned long lines[BATCH_WINDOW + 1][BATCH_SIZE];
+	size_t offsets[BATCH_WINDOW + 1][BATCH_SIZE + 1];
+	char *text[BATCH_WINDOW + 1];
+	size_t text_capacity[BATCH_WINDOW + 1];
+	unsigned sizes[BATCH_WINDOW + 1];
+	unsigned head, count;
+
+	/* Lines of songs added, in playlist order; retried ones end up
+	 * after later batches and are moved back in place at the end. */
+	unsigned long *order;
+	size_t order_len, order_capacity;
+	int shuffled;
+
+	unsigned long failures;
+};
+
+static struct target *targets;
+static struct pollfd *target_pfds;
+static unsigned targets_count, batch_commands;
+static const char *batch_unit = "line";
+
+
+static void target_err(const struct target *t, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+static void target_err(const struct target *t, const char *fmt, ...) {
+	va_list ap;
+	fprintf(stderr, "%s: ", program_name);
+	if (targets_count > 1) {
+		fprintf(stderr, "%s: ", t->name);
+	}
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	putc('\n', stderr);
+}
+
+static void target_fail(struct target *t, const char *msg) {
+	unsigned i;
+
+	if (t->fd < 0) {
+		return;
+	}
+	close(t->fd);
+	t->fd = -1;
+	t->error = xstrdup(msg);
+	free(t->out);
+	t->out = 0;
+	t->out_start = t->out_len = t->out_capacity = 0;
+	t->count = 0;
+	for (i = 0; i <= BATCH_WINDOW; ++i) {
+		free(t->text[i]);
+		t->text[i] = 0;
+		t->text_capacity[i] = 0;
+	}
+}
+
+
+static void target_reserve(struct target *t, size_t len) {
+	if (t->out_len + len <= t->out_capacity) {
+		return;
+	}
+
+	/* Drop what has been sent already before growing */
+	if (t->out_start) {
+		t->out_len -= t->out_start;
+		memmove(t->out, t->out + t->out_start, t->out_len);
+		t->out_start = 0;
+		if (t->out_len + len <= t->out_capacity) {
+			return;
+		}
+	}
+
+	if (!t->out_capacity) t->out_capacity = 4096;
+	while (t->out_capacity < t->out_len + len) {
+		t->out_capacity *= 2;
+	}
+	t->out = realloc(t->out, t->out_capacity);
+	if (!t->out) {
+		ERR("%s", "out of memory");
+		exit(1);
+	}
+}
+
+static void target_append(struct target *t, const char *str, size_t len) {
+	target_reserve(t, len);
+	memcpy(t->out + t->out_len, str, len);
+	t->out_len += len;
+}
+
+/* Keeps command n of the batch in slot in case it needs sending again. */
+static void target_keep(struct target *t, unsigned slot, unsigned n,
+                        unsigned long line, const char *cmd, size_t len) {
+	const size_t start = n ? t->offsets[slot][n] : 0;
+
+	if (start + len > t->text_capacity[slot]) {
+		t->text_capacity[slot] = (start + len) * 2;
+		t->text[slot] = xrealloc(t->text[slot], t->text_capacity[slot]);
+	}
+	memcpy(t->text[slot] + start, cmd, len);
+	t->lines[slot][n] = line;
+	t->offsets[slot][n] = start;
+	t->offsets[slot][n + 1] = start + len;
+}
+
+/* Queues n commands, i-th at text + offsets[i], as a batch to this
+ * target only.  Called only between batches so nothing is being built
+ * and only when there's room for another batch. */
+static void target_batch(struct target *t, const unsigned long *lines,
+                         const char *text, const size_t *offsets,
+                         unsigned n) {
+	const unsigned slot = (t->head + t->count) % (BATCH_WINDOW + 1);
+	unsigned i;
+
+	target_append(t, "command_list_begin\n", 19);
+	for (i = 0; i < n; ++i) {
+		target_keep(t, slot, i, lines[i], text + offsets[i],
+		            offsets[i + 1] - offsets[i]);
+		target_append(t, text + offsets[i], offsets[i + 1] - offsets[i]);
+	}
+	target_append(t, "command_list_end\n", 17);
+	t->sizes[slot] = n;
+	++t->count;
+}
+
+/* Records that commands before done in batch idx were executed. */
+static void target_done(struct target *t, unsigned idx, unsigned done) {
+	unsigned n;
+
+	for (n = 0; n < done; ++n) {
+		if (memcmp(t->text[idx] + t->offsets[idx][n], "add ", 4)) {
+			continue;
+		}
+		if (t->order_len == t->order_capacity) {
+			t->order_capacity = t->order_len ? t->order_len * 2 : 1024;
+			t->order = xrealloc(t->order,
+			                    t->order_capacity * sizeof *t->order);
+		}
+		if (t->order_len && t->order[t->order_len - 1] > t->lines[idx][n]) {
+			t->shuffled = 1;
+		}
+		t->order[t->order_len++] = t->lines[idx][n];
+	}
+}
+
+
+/* Appends str to buf as a quoted MPD argument followed by a new line. */
+static size_t quote_arg(char **buf, size_t *capacity, size_t len,
+                        const char *str, size_t str_len) {
+	const char *const end = str + str_len;
+	size_t need = len + str_len * 2 + 3;
+	char *o;
+
+	if (need > *capacity) {
+		*capacity = need * 2;
+		*buf = realloc(*buf, *capacity);
+		if (!*buf) {
+			ERR("%s", "out of memory");
+			exit(1);
+		}
+	}
+
+	o = *buf + len;
+	*o++ = '"';
+	for (; str < end; ++str) {
+		if (*str == '"' || *str == '\\') {
+			*o++ = '\\';
+		}
+		*o++ = *str;
+	}
+	*o++ = '"';
+	*o++ = '\n';
+	return o - *buf;
+}
+
+
+/* Parses [<password>@]<host>[:<port>] and starts connecting. */
+static void target_open(struct target *t, char *arg) {
+	struct addrinfo hints, *res, *ai;
+	char *copy, *host, *password = 0, *port, *p;
+	int ret;
+
+	t->name = arg;
+	t->fd = -1;
+
+	host = copy = xstrdup(arg);
+	p = strchr(host, '@');
+	if (p) {
+		*p = 0;
+		password = host;
+		host = p + 1;
+	}
+
+	/* A colon in a bracketed or plain IPv6 address is not a port */
+	port = 0;
+	if (*host == '[' && (p = strchr(host, ']'))) {
+		*p = 0;
+		++host;
+		if (p[1] == ':') port = p + 2;
+	} else if ((p = strchr(host, ':')) && !strchr(p + 1, ':')) {
+		*p = 0;
+		port = p + 1;
+	}
+	if (!port && !(port = (char*)portarg) && !(port = getenv("MPD_PORT"))) {
+		port = (char*)DEFAULT_PORT;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		t->error = xstrdup(gai_strerror(ret));
+		free(copy);
+		return;
+	}
+
+	errno = 0;
+	for (ai = res; ai; ai = ai->ai_next) {
+		t->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (t->fd < 0) {
+			continue;
+		}
+		if (fcntl(t->fd, F_SETFL, O_NONBLOCK) >= 0 &&
+		    (!connect(t->fd, ai->ai_addr, ai->ai_addrlen) ||
+		     errno == EINPROGRESS)) {
+			break;
+		}
+		close(t->fd);
+		t->fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (t->fd < 0) {
+		t->error = xstrdup(errno ? strerror(errno) : "could not connect");
+	} else if (password) {
+		/* Queue it now, it'll be sent once connection is established */
+		char *buf = xstrdup("password ");
+		size_t capacity = 10;
+		size_t len = quote_arg(&buf, &capacity, 9,
+		                       password, strlen(password));
+		target_append(t, buf, len);
+		t->sizes[0] = 0;
+		t->count = 1;
+		free(buf);
+	}
+
+	free(copy);
+}
+
+
+static void target_response(struct target *t, char *line) {
+	const unsigned idx = t->head;
+	unsigned at;
+	char *p;
+
+	if (!t->welcomed) {
+		if (strncmp(line, "OK MPD ", 7)) {
+			target_fail(t, "not an MPD server");
+		}
+		t->welcomed = 1;
+		return;
+	}
+
+	if (!t->count) {
+		return;
+	}
+
+	if (!strncmp(line, "ACK", 3)) {
+		if (!t->sizes[idx]) {
+			target_fail(t, line);
+			return;
+		}
+
+		/* ACK [<error>@<command index>] {<command>} <message> */
+		p = strchr(line, '@');
+		at = p ? strtoul(p + 1, 0, 10) : 0;
+		if (at >= t->sizes[idx]) {
+			at = t->sizes[idx] - 1;
+		}
+		target_err(t, "%s %lu: %s", batch_unit, t->lines[idx][at], line);
+		++t->failures;
+	} else if (strcmp(line, "OK")) {
+		return;
+	} else {
+		at = t->sizes[idx];
+	}
+
+	target_done(t, idx, at);
+	t->head = (t->head + 1) % (BATCH_WINDOW + 1);
+	--t->count;
+
+	/* The ACK aborted the rest of the command list; send it again */
+	if (at + 1 < t->sizes[idx]) {
+		target_batch(t, t->lines[idx] + at + 1, t->text[idx],
+		             t->offsets[idx] + at + 1, t->sizes[idx] - at - 1);
+	}
+}
+
+static void target_io(struct target *t, short revents) {
+	ssize_t ret;
+	char *nl;
+
+	if (revents & POLLOUT) {
+		ret = send(t->fd, t->out + t->out_start,
+		           t->out_len - t->out_start, MSG_NOSIGNAL);
+		if (ret > 0) {
+			t->out_start += ret;
+			if (t->out_start == t->out_len) {
+				t->out_start = t->out_len = 0;
+			}
+		} else if (errno != EAGAIN && errno != EINTR) {
+			target_fail(t, strerror(errno));
+			return;
+		}
+	}
+
+	if (!(revents & (POLLIN | POLLHUP | POLLERR))) {
+		return;
+	}
+
+	ret = recv(t->fd, t->in + t->in_len, sizeof t->in - 1 - t->in_len, 0);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	} else if (ret < 0) {
+		target_fail(t, strerror(errno));
+		return;
+	} else if (!ret) {
+		target_fail(t, "connection closed");
+		return;
+	}
+	t->in_len += ret;
+	t->in[t->in_len] = 0;
+
+	while (t->fd >= 0 && (nl = strchr(t->in, '\n'))) {
+		*nl = 0;
+		target_response(t, t->in);
+		t->in_len -= nl + 1 - t->in;
+		memmove(t->in, nl + 1, t->in_len + 1);
+	}
+
+	/* Overlong line; the beginning is enough to tell OK from ACK */
+	if (t->in_len == sizeof t->in - 1) {
+		t->in_len = 4;
+	}
+}
+
+/* Sends what there is to send and reads acknowledgements on all
+ * targets waiting at most timeout milliseconds for either to become
+ * possible.  On timeout, targets which were still busy are dropped. */
+static void batch_pump(int timeout) {
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < targets_count; ++i) {
+		struct target *const t = targets + i;
+		target_pfds[i].fd = t->fd;
+		target_pfds[i].events = POLLIN;
+		target_pfds[i].revents = 0;
+		if (t->out_start < t->out_len) {
+			target_pfds[i].events |= POLLOUT;
+		}
+	}
+
+	ret = poll(target_pfds, targets_count, timeout);
+	if (ret < 0 && errno == EINTR) {
+		return;
+	} else if (ret < 0) {
+		ERR("poll: %s", strerror(errno));
+		exit(2);
+	}
+
+	for (i = 0; i < targets_count; ++i) {
+		struct target *const t = targets + i;
+		if (t->fd < 0) {
+			continue;
+		} else if (target_pfds[i].revents) {
+			target_io(t, target_pfds[i].revents);
+		} else if (!ret && timeout && (!t->welcomed || t->count ||
+		                               t->out_start < t->out_len)) {
+			target_fail(t, "connection timeout");
+		}
+	}
+}
+
+
+static void batch_end(void) {
+	unsigned i;
+
+	if (!batch_commands) {
+		return;
+	}
+
+	for (i = 0; i < targets_count; ++i) {
+		struct target *const t = targets + i;
+		if (t->fd < 0) continue;
+		target_append(t, "command_list_end\n", 17);
+		t->sizes[(t->head + t->count) % (BATCH_WINDOW + 1)] = batch_commands;
+		++t->count;
+	}
+	batch_commands = 0;
+
+	/* Get the data going but don't wait */
+	batch_pump(0);
+}
+
+static void batch_command(unsigned long line, const char *cmd, size_t len) {
+	unsigned i;
+
+	if (!batch_commands) {
+		/* Wait until every target has room for another batch */
+		for (i = 0; i < targets_count; ) {
+			if (targets[i].fd >= 0 && targets[i].count == BATCH_WINDOW) {
+				batch_pump(BATCH_TIMEOUT);
+				i = 0;
+			} else {
+				++i;
+			}
+		}
+	}
+
+	for (i = 0; i < targets_count; ++i) {
+		struct target *const t = targets + i;
+		if (t->fd < 0) continue;
+		if (!batch_commands) {
+			target_append(t, "command_list_begin\n", 19);
+		}
+		target_keep(t, (t->head + t->count) % (BATCH_WINDOW + 1),
+		            batch_commands, line, cmd, len);
+		target_append(t, cmd, len);
+	}
+
+	if (++batch_commands == BATCH_SIZE) {
+		batch_end();
+	}
+}
+
+
+static void batch_printf(unsigned long line, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+static void batch_printf(unsigned long line, const char *fmt, ...) {
+	char buf[128];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+	batch_command(line, buf, len);
+}
+
+static void batch_add(unsigned long line, const char *path, size_t len) {
+	static char *buf;
+	static size_t capacity;
+
+	if (!buf) {
+		capacity = 256;
+		buf = malloc(capacity);
+		if (!buf) {
+			ERR("%s", "out of memory");
+			exit(1);
+		}
+	}
+	memcpy(buf, "add ", 4);
+	batch_command(line, buf, quote_arg(&buf, &capacity, 4, path, len));
+}
+
+static void batch_finish(void) {
+	unsigned i;
+
+	batch_end();
+	for (i = 0; i < targets_count; ) {
+		const struct target *const t = targets + i;
+		if (t->fd >= 0 && (!t->welcomed || t->count ||
+		                   t->out_start < t->out_len)) {
+			batch_pump(BATCH_TIMEOUT);
+			i = 0;
+		} else {
+			++i;
+		}
+	}
+}
+
+
+static int compare_lines(const void *a, const void *b) {
+	const unsigned long x = *(const unsigned long *)a;
+	const unsigned long y = *(const unsigned long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Moves songs which were added again after a failure, and so after
+ * those of later batches, back in place.  Call once all batches are
+ * acknowledged; positions are known only if the playlist was cleared. */
+static void batch_reorder(void) {
+	unsigned long *sorted, *lines;
+	size_t *offsets, len, capacity, p, q, n, i;
+	char *text, cmd[64];
+	unsigned k;
+
+	for (k = 0; k < targets_count; ++k) {
+		struct target *const t = targets + k;
+		if (t->fd < 0 || !t->shuffled) continue;
+
+		sorted = xrealloc(0, t->order_len * sizeof *sorted);
+		memcpy(sorted, t->order, t->order_len * sizeof *sorted);
+		qsort(sorted, t->order_len, sizeof *sorted, compare_lines);
+
+		lines = 0;
+		offsets = xrealloc(0, sizeof *offsets);
+		offsets[0] = 0;
+		text = 0;
+		n = capacity = 0;
+		for (p = 0; p < t->order_len; ++p) {
+			if (t->order[p] == sorted[p]) continue;
+			for (q = p + 1; t->order[q] != sorted[p]; ++q);
+			memmove(t->order + p + 1, t->order + p,
+			        (q - p) * sizeof *t->order);
+			t->order[p] = sorted[p];
+
+			len = sprintf(cmd, "move \"%lu\" \"%lu\"\n",
+			              (unsigned long)q, (unsigned long)p);
+			if (offsets[n] + len > capacity) {
+				capacity = (offsets[n] + len) * 2;
+				text = xrealloc(text, capacity);
+			}
+			memcpy(text + offsets[n], cmd, len);
+			lines = xrealloc(lines, (n + 1) * sizeof *lines);
+			offsets = xrealloc(offsets, (n + 2) * sizeof *offsets);
+			lines[n] = sorted[p];
+			offsets[n + 1] = offsets[n] + len;
+			++n;
+		}
+
+		for (i = 0; i < n && t->fd >= 0; ) {
+			if (t->count == BATCH_WINDOW) {
+				batch_pump(BATCH_TIMEOUT);
+				continue;
+			}
+			len = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+			target_batch(t, lines + i, text, offsets + i, len);
+			i += len;
+		}
+		t->shuffled = 0;
+
+		free(sorted);
+		free(lines);
+		free(offsets);
+		free(text);
+	}
+}
+
+
+
+/********** Reading input **********/
+/*
+ * Regular files are mapped and parsed in place, anything else is read
+ * through a buffer which grows as needed to hold the longest line.
+ * Either way a line is a pointer and a length into input.data; it is
+ * never copied nor NUL terminated and stays valid until the next call
+ * to input_line().
+ */
+#define INPUT_BUFFER 65536
+
+static struct {
+	const char *data;
+	size_t pos, len, scanned;
+	char *buf;
+	size_t capacity;
+	int fd, eof;
+} input;
+
+
+static void input_open(int fd) {
+	struct stat st;
+	void *p;
+
+	input.fd = fd;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (size_t)st.st_size == (unsigned long long)st.st_size) {
+		p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			input.data = p;
+			input.len = st.st_size;
+			input.eof = 1;
+			return;
+		}
+	}
+
+	input.capacity = INPUT_BUFFER;
+	input.data = input.buf = malloc(input.capacity);
+	if (!input.buf) {
+		ERR("%s", "out of memory");
+		exit(1);
+	}
+}
+
+static void input_fill(void) {
+	ssize_t ret;
+
+	/* Drop consumed data and grow if there's still no room */
+	if (input.pos) {
+		input.len -= input.pos;
+		input.scanned -= input.pos;
+		memmove(input.buf, input.buf + input.pos, input.len);
+		input.pos = 0;
+	}
+	if (input.len == input.capacity) {
+		input.capacity *= 2;
+		input.data = input.buf = realloc(input.buf, input.capacity);
+		if (!input.buf) {
+			ERR("%s", "out of memory");
+			exit(1);
+		}
+	}
+
+	do {
+		ret = read(input.fd, input.buf + input.len,
+		           input.capacity - input.len);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		ERR("error reading input: %s", strerror(errno));
+		exit(1);
+	}
+	input.len += ret;
+	input.eof = !ret;
+}
 
-	mpd_sendCommandListBegin(conn);
-	if (!opt_skip_playlist && !opt_add) mpd_sendClearCommand(conn);
+/* Returns next line without new line character or NULL at the end. */
+static const char *input_line(size_t *len) {
+	const char *line, *nl;
+
+	input.scanned = input.pos;
+	while (!(nl = memchr(input.data + input.scanned, '\n',
+	                     input.len - input.scanned))) {
+		input.scanned = input.len;
+		if (input.eof) break;
+		input_fill();
+	}
+
+	if (input.pos == input.len) {
+		return 0;
+	}
+
+	line = input.data + input.pos;
+	*len = (nl ? nl : input.data + input.len) - line;
+	input.pos += *len + !!nl;
+	return line;
+}
 
-	while (fgets(buffer, LINELENGTH, stdin)) {
-		word = strtok(buffer, ": \f\r\t\v\n");
-		str  = strtok(0, ": \f\r\t\v\n");
 
-		if (!strcmp(word, "state")) {
-			if (!strcmp(word, "play")) state = MPD_STATUS_STATE_PLAY;
-			else if (!strcmp(word, "pause")) state = MPD_STATUS_STATE_PAUSE;
-			else if (!strcmp(word, "stop")) state = MPD_STATUS_STATE_STOP;
+/* Makes sure there are at least n bytes of input past the current
+ * position and returns non-zero if so. */
+static int input_peek(size_t n) {
+	while (input.len - input.pos < n && !input.eof) {
+		input_fill();
+	}
+	return input.len - input.pos >= n;
+}
+
+/* Returns next n bytes of input; exits if there are not as many. */
+static const unsigned char *input_bytes(size_t n) {
+	const char *ret;
+	if (!input_peek(n)) {
+		ERR("%s", "truncated binary state on input");
+		exit(1);
+	}
+	ret = input.data + input.pos;
+	input.pos += n;
+	return (const unsigned char *)ret;
+}
+
+
+/* Like atoi() but stops at end. */
+static int parse_int(const char *str, const char *end) {
+	int neg = 0, ret = 0;
+
+	while (str < end && (*str == ' ' || *str == '\t')) ++str;
+	if (str < end && (*str == '-' || *str == '+')) neg = *str++ == '-';
+	for (; str < end && *str >= '0' && *str <= '9'; ++str) {
+		ret = ret * 10 + (*str - '0');
+	}
+	return neg ? -ret : ret;
+}
+
+/* Like strtok(str, ": \f\r\t\v") but stops at end and does not modify
+ * the string. */
+static const char *token(const char **str, const char *end, size_t *len) {
+	static const char delim[] = ": \f\r\t\v";
+	const char *p = *str, *tok;
+
+	while (p < end && memchr(delim, *p, sizeof delim - 1)) ++p;
+	tok = p;
+	while (p < end && !memchr(delim, *p, sizeof delim - 1)) ++p;
+	*str = p;
+	*len = p - tok;
+	return tok;
+}
+
+#define IS(str, len, lit) \
+	((len) == sizeof lit - 1 && !memcmp(str, lit, sizeof lit - 1))
+
+
+
+/********** Restore state from stdin **********/
+static struct {
+	int state, seconds, song;
+	unsigned long line;
+} playback = { MPD_STATUS_STATE_STOP, MPD_PLAY_AT_BEGINNING, 0, 0 };
+
+
+static void restore_text(void) {
+	const char *buffer, *end, *word, *str;
+	size_t len, wlen, slen;
+	unsigned long line = 0;
+	int num;
+
+	while ((buffer = input_line(&len))) {
+		end = buffer + len;
+		++line;
+		str = buffer;
+		word = token(&str, end, &wlen);
+		str  = token(&str, end, &slen);
+		if (!wlen) continue;
+		num = parse_int(str, str + slen);
+
+		if (IS(word, wlen, "state")) {
+			if (IS(str, slen, "play")) playback.state = MPD_STATUS_STATE_PLAY;
+			else if (IS(str, slen, "pause")) playback.state = MPD_STATUS_STATE_PAUSE;
+			else if (IS(str, slen, "stop")) playback.state = MPD_STATUS_STATE_STOP;
 			else {
-				ERR("invalid state: %s", word);
+				fprintf(stderr, "%s: invalid state: %.*s\n",
+				        program_name, (int)slen, str);
 				exit(3);
 			}
 
-		} else if (!strcmp(word, "current")) {
-			songnum = atoi(str);
-		} else if (!strcmp(word,  "time")) {
-			seconds = atoi(str);
-
-		} else if (!strcmp(word, "volume")) {
-			if (!opt_skip_state) mpd_sendSetvolCommand(conn, atoi(str));
-		} else if (!strcmp(word, "random")) {
-			if (!opt_skip_state) mpd_sendRandomCommand(conn, atoi(str));
-		} else if (!strcmp(word, "repeat")) {
-			if (!opt_skip_state) mpd_sendRepeatCommand(conn, atoi(str));
-		} else if (!strcmp(word, "crossfade")) {
-			if (!opt_skip_state) mpd_sendCrossfadeCommand(conn, atoi(str));
-
-		} else if (!strcmp(word, "playlist_begin")) {
-			while (fgets(buffer, LINELENGTH, stdin) &&
-				   strcmp(word, "playlist_end\n") &&
-				   (str = strchr(buffer, ':'))) {
-				if (!opt_skip_playlist) continue;
+		} else if (IS(word, wlen, "current")) {
+			playback.song = num;
+		} else if (IS(word, wlen, "time")) {
+			playback.seconds = num;
+
+		} else if (IS(word, wlen, "volume")) {
+			/* -1 means there is no mixer to set */
+			if (!opt_skip_state && num >= 0) {
+				batch_printf(line, "setvol \"%i\"\n", num);
+			}
+		} else if (IS(word, wlen, "random")) {
+			if (!opt_skip_state) batch_printf(line, "random \"%i\"\n", num);
+		} else if (IS(word, wlen, "repeat")) {
+			if (!opt_skip_state) batch_printf(line, "repeat \"%i\"\n", num);
+		} else if (IS(word, wlen, "crossfade")) {
+			if (!opt_skip_state) batch_printf(line, "crossfade \"%i\"\n", num);
+
+		} else if (IS(word, wlen, "playlist_begin")) {
+			while ((buffer = input_line(&len)) && ++line &&
+			       !IS(buffer, len, "playlist_end") &&
+			       (str = memchr(buffer, ':', len))) {
+				if (opt_skip_playlist) continue;
 
 				++str;
-				str[strlen(str)-1] = '\0';
-				mpd_sendAddCommand(conn, str);
+				batch_add(line, str, buffer + len - str);
 			}
 
-		} else if (!strcmp(word,"outputs_begin")) {
-			while (fgets(buffer, LINELENGTH, stdin) &&
-				   strcmp(word, "outputs_end\n") &&
-				   (str = strchr(buffer, ':'))) {
+		} else if (IS(word, wlen, "delta_begin")) {
+			ERR("%s", "differential state on input, merge it with -c first");
+			exit(1);
+
+		} else if (IS(word, wlen, "outputs_begin")) {
+			while ((buffer = input_line(&len)) && ++line &&
+			       !IS(buffer, len, "outputs_end") &&
+			       (str = memchr(buffer, ':', len))) {
 				if (opt_skip_outputs) continue;
 
-				if (atoi(str+1)) {
-					mpd_sendEnableOutputCommand(conn, atoi(buffer));
-				} else {
-					mpd_sendDisableOutputCommand(conn, atoi(buffer));
+				num = parse_int(str + 1, buffer + len);
+				batch_printf(line, "%soutput \"%i\"\n",
+				             num ? "enable" : "disable",
+				             parse_int(buffer, str));
+			}
+		}
+	}
+
+	playback.line = line;
+}
+
+
+static void restore(void) {
+	unsigned i;
+	int ret = 0;
+
+	/* Connect to all targets at once */
+	targets_count = hostargs_count ? hostargs_count : 1;
+	targets = calloc(targets_count, sizeof *targets);
+	target_pfds = malloc(targets_count * sizeof *target_pfds);
+	if (!targets || !target_pfds) {
+		ERR("%s", "out of memory");
+		exit(1);
+	}
+	if (!hostargs_count && !(hostarg = getenv("MPD_HOST"))) {
+		hostarg = (char*)DEFAULT_HOST;
+	}
+	for (i = 0; i < targets_count; ++i) {
+		target_open(targets + i, hostargs_count ? hostargs[i] : hostarg);
+	}
+
+	if (!opt_skip_playlist && !opt_add) batch_printf(0, "clear\n");
+
+	input_open(0);
+	if (input_peek(BINARY_MAGIC_LEN) &&
+	    !memcmp(input.data + input.pos, BINARY_MAGIC, BINARY_MAGIC_LEN)) {
+		restore_binary();
+	} else {
+		restore_text();
+	}
+
+	if (!opt_add) {
+		batch_finish();
+		batch_reorder();
+	}
+
+	if (!opt_skip_state && playback.state!=MPD_STATUS_STATE_STOP) {
+		if (playback.seconds < 0) {
+			batch_printf(playback.line, "play \"%i\"\n", playback.song);
+		} else {
+			batch_printf(playback.line, "seek \"%i\" \"%i\"\n",
+			             playback.song, playback.seconds);
+		}
+		if (playback.state == MPD_STATUS_STATE_PAUSE) {
+			batch_printf(playback.line, "pause \"1\"\n");
+		}
+	}
+
+	batch_finish();
+
+	/* Summary */
+	for (i = 0; i < targets_count; ++i) {
+		struct target *const t = targets + i;
+		if (t->error) {
+			target_err(t, "error: %s", t->error);
+			ret = 2;
+		} else if (t->failures) {
+			target_err(t, "%lu command(s) failed", t->failures);
+			ret = 2;
+		} else if (targets_count > 1) {
+			target_err(t, "%s", "restored");
+		}
+		if (t->fd >= 0) close(t->fd);
+	}
+	if (ret) {
+		exit(ret);
+	}
+}
+
+
+
+/********** Binary state **********/
+/*
+ * With -b state is dumped in a binary format which is faster to
+ * produce and parse for big playlists.  Restore tells it from text by
+ * the magic.  Numbers are little endian and, apart from counts and
+ * lengths, signed:
+ *
+ *   magic     4 bytes  "\211MPS"
+ *   version   1 byte   BINARY_VERSION
+ *   sections  1 byte   BINARY_STATUS | BINARY_PLAYLIST | BINARY_OUTPUTS
+ *   reserved  2 bytes
+ *   state     1 byte   MPD_STATUS_STATE_*
+ *   random    1 byte
+ *   repeat    1 byte
+ *   reserved  1 byte
+ *   volume    4 bytes
+ *   crossfade 4 bytes
+ *   current   4 bytes
+ *   time      4 bytes
+ *
+ * which is followed by the playlist if present:
+ *
+ *   count     4 bytes
+ *   count times a 4 byte length and that many bytes of path
+ *
+ * and then by the outputs if present:
+ *
+ *   count     4 bytes
+ *   count times a 4 byte id and 1 byte which is 1 if the output is
+ *   enabled and 0 if not; ids need not be contiguous
+ *
+ * In error messages the header is record 0, playlist entries are
+ * records 1 to count and outputs are the ones after that.
+ */
+#define BINARY_STATUS   1
+#define BINARY_PLAYLIST 2
+#define BINARY_OUTPUTS  4
+#define BINARY_HEADER   28
+
+static void put32(unsigned char *p, unsigned long v) {
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static unsigned long get32(const unsigned char *p) {
+	return p[0] | (unsigned long)p[1] << 8 |
+		(unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+static int get32s(const unsigned char *p) {
+	unsigned long v = get32(p);
+	return v & 0x80000000UL ? -(int)(~v & 0x7fffffffUL) - 1 : (int)v;
+}
+
+
+static void *xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		ERR("%s", "out of memory");
+		exit(1);
+	}
+	return ptr;
+}
+
+static void print_binary(void) {
+	unsigned char header[BINARY_HEADER], *buf = 0;
+	size_t len = 0, capacity = 0;
+	unsigned long count = 0;
+
+	memset(header, 0, sizeof header);
+	memcpy(header, BINARY_MAGIC, BINARY_MAGIC_LEN);
+	header[4] = BINARY_VERSION;
+	header[5] = (opt_skip_state    ? 0 : BINARY_STATUS) |
+	            (opt_skip_playlist ? 0 : BINARY_PLAYLIST) |
+	            (opt_skip_outputs  ? 0 : BINARY_OUTPUTS);
+
+	if (!opt_skip_state) {
+		mpd_Status *status = get_status();
+		header[8]  = status->state;
+		header[9]  = !!status->random;
+		header[10] = !!status->repeat;
+		put32(header + 12, status->volume);
+		put32(header + 16, status->crossfade);
+		put32(header + 20, status->song);
+		put32(header + 24, status->elapsedTime);
+		mpd_freeStatus(status);
+	}
+	fwrite(header, 1, sizeof header, out);
+
+	if (!opt_skip_playlist) {
+		mpd_InfoEntity *entity;
+
+		mpd_sendPlaylistInfoCommand(conn, -1);
+		while ((entity = mpd_getNextInfoEntity(conn))) {
+			if (entity->type==MPD_INFO_ENTITY_TYPE_SONG) {
+				const char *file = entity->info.song->file;
+				size_t l = strlen(file);
+				if (len + l + 4 > capacity) {
+					capacity = (len + l + 4) * 2;
+					buf = xrealloc(buf, capacity);
+				}
+				put32(buf + len, l);
+				memcpy(buf + len + 4, file, l);
+				len += l + 4;
+				++count;
+			}
+			mpd_freeInfoEntity(entity);
+		}
+		mpd_finishCommand(conn);
+		print_error_and_exit(3);
+
+		put32(header, count);
+		fwrite(header, 1, 4, out);
+		fwrite(buf, 1, len, out);
+	}
+
+	if (!opt_skip_outputs) {
+		mpd_OutputEntity *output;
+
+		len = count = 0;
+		mpd_sendOutputsCommand(conn);
+		while ((output = mpd_getNextOutput(conn))) {
+			if (output->id >= 0) {
+				if (len + 5 > capacity) {
+					capacity = (len + 5) * 2;
+					buf = xrealloc(buf, capacity);
 				}
+				put32(buf + len, output->id);
+				buf[len + 4] = !!output->enabled;
+				len += 5;
+				++count;
 			}
+			mpd_freeOutputElement(output);
 		}
+		mpd_finishCommand(conn);
+		print_error_and_exit(3);
+
+		put32(header, count);
+		fwrite(header, 1, 4, out);
+		fwrite(buf, 1, len, out);
 	}
 
-	if (!opt_skip_state && state!=MPD_STATUS_STATE_STOP) {
-		mpd_sendSeekCommand(conn, songnum, seconds);
+	free(buf);
+	if (fflush(out)) {
+		ERR("error writing output: %s", strerror(errno));
+		exit(1);
 	}
+}
 
-	mpd_sendCommandListEnd(conn);
-	print_error_and_exit(2);
-	mpd_finishCommand(conn);
+
+static void restore_binary(void) {
+	const unsigned char *p = input_bytes(BINARY_HEADER);
+	unsigned long count, record = 0, i, len;
+	unsigned sections;
+
+	batch_unit = "record";
+	if (p[4] != BINARY_VERSION) {
+		ERR("unsupported binary state version %u", p[4]);
+		exit(1);
+	}
+	sections = p[5];
+
+	if (!(sections & BINARY_STATUS)) {
+		playback.state = MPD_STATUS_STATE_STOP;
+	} else {
+		playback.state = p[8];
+		playback.song = get32s(p + 20);
+		playback.seconds = get32s(p + 24);
+		if (!opt_skip_state) {
+			if (get32s(p + 12) >= 0) {
+				batch_printf(0, "setvol \"%i\"\n", get32s(p + 12));
+			}
+			batch_printf(0, "random \"%i\"\n", p[9]);
+			batch_printf(0, "repeat \"%i\"\n", p[10]);
+			batch_printf(0, "crossfade \"%i\"\n", get32s(p + 16));
+		}
+	}
+
+	if (sections & BINARY_PLAYLIST) {
+		count = get32(input_bytes(4));
+		while (record < count) {
+			len = get32(input_bytes(4));
+			p = input_bytes(len);
+			++record;
+			if (!opt_skip_playlist) {
+				batch_add(record, (const char *)p, len);
+			}
+		}
+	}
+
+	if (sections & BINARY_OUTPUTS) {
+		count = get32(input_bytes(4));
+		for (i = 0; i < count; ++i) {
+			p = input_bytes(5);
+			++record;
+			if (!opt_skip_outputs) {
+				batch_printf(record, "%soutput \"%lu\"\n",
+				             p[4] ? "enable" : "disable", get32(p));
+			}
+		}
+	}
+
+	playback.line = record;
 }
 
 
 
 /********** Prints MPD's status to stdout **********/
-static void print_status(void) {
+static mpd_Status *get_status(void) {
 	mpd_Status *status;
 
 	mpd_sendStatusCommand(conn);
@@ -293,19 +1389,27 @@ static void print_status(void) {
 	print_error_and_exit(3);
 	mpd_nextListOkCommand(conn);
 	print_error_and_exit(3);
+	mpd_finishCommand(conn);
+	print_error_and_exit(3);
 
-	printf("state: %s\n", status->state==MPD_STATUS_STATE_PLAY ? "play"
-		   : (status->state==MPD_STATUS_STATE_PAUSE ? "pause" : "stop"));
-	printf("current: %i\n", status->song);
-	printf("time: %i\n", status->elapsedTime);
-	printf("random: %i\n", status->random ? 1 : 0 );
-	printf("repeat: %i\n", status->repeat ? 1 : 0 );
-	printf("crossfade: %i\n",status->crossfade ? 1 : 0 );
-	printf("volume: %i\n", status->volume);
+	return status;
+}
 
-	mpd_finishCommand(conn);
+static void print_status(void) {
+	mpd_Status *status = get_status();
+	print_status_lines(status);
 	mpd_freeStatus(status);
-	print_error_and_exit(3);
+}
+
+static void print_status_lines(const mpd_Status *status) {
+	fprintf(out, "state: %s\n", status->state==MPD_STATUS_STATE_PLAY ? "play"
+		   : (status->state==MPD_STATUS_STATE_PAUSE ? "pause" : "stop"));
+	fprintf(out, "current: %i\n", status->song);
+	fprintf(out, "time: %i\n", status->elapsedTime);
+	fprintf(out, "random: %i\n", status->random ? 1 : 0 );
+	fprintf(out, "repeat: %i\n", status->repeat ? 1 : 0 );
+	fprintf(out, "crossfade: %i\n",status->crossfade ? 1 : 0 );
+	fprintf(out, "volume: %i\n", status->volume);
 }
 
 
@@ -314,19 +1418,19 @@ static void print_status(void) {
 static void print_playlist(void) {
 	mpd_InfoEntity *entity;
 
-	puts("playlist_begin");
+	fputs("playlist_begin\n", out);
 
 	mpd_sendPlaylistInfoCommand(conn,-1);
 	while ((entity = mpd_getNextInfoEntity(conn))) {
 		if (entity->type==MPD_INFO_ENTITY_TYPE_SONG) {
 			mpd_Song *song = entity->info.song;
-			printf("%i:%s\n", song->pos, song->file);
+			fprintf(out, "%i:%s\n", song->pos, song->file);
 		}
 		mpd_freeInfoEntity(entity);
 	}
 	mpd_finishCommand(conn);
 
-	puts("playlist_end");
+	fputs("playlist_end\n", out);
 	print_error_and_exit(3);
 }
 
@@ -335,23 +1439,299 @@ static void print_playlist(void) {
 /********** Prints outputs to stdout **********/
 static void print_outputs(void) {
 	mpd_OutputEntity * output;
-	puts("outputs_begin");
+	fputs("outputs_begin\n", out);
 
 	mpd_sendOutputsCommand(conn);
 	while ((output = mpd_getNextOutput(conn))) {
 		if (output->id >= 0) {
-			printf("%i:%i:%s\n", output->id, output->enabled, output->name);
+			fprintf(out, "%i:%i:%s\n", output->id, output->enabled, output->name);
 		}
 		mpd_freeOutputElement(output);
 	}
 	mpd_finishCommand(conn);
 
-	puts("outputs_end");
+	fputs("outputs_end\n", out);
 	print_error_and_exit(3);
 }
 
 
 
+/********** Differential state **********/
+/*
+ * With -d, state is appended to a file as a delta record:
+ *
+ *   delta_begin
+ *   <status lines as printed by print_status()>
+ *   length: <playlist length>
+ *   changes_begin
+ *   <pos>:<file>          (entries which changed since previous record)
+ *   changes_end
+ *   outputs_begin ... outputs_end
+ *   version: <playlist version>
+ *   started: <time MPD has been started at>
+ *   delta_end
+ *
+ * If the file is empty, MPD has been restarted since or the playlist
+ * version went backwards, a full state followed by version and started
+ * lines replaces the file instead.  Those two lines thus always end up
+ * near the end of the file and only its tail needs reading.
+ *
+ * compact() replays the records and rewrites the file as a single full
+ * state.  Both write a temporary file and move it over the old one so
+ * a crash never leaves it half-written.
+ */
+
+static FILE *open_new(const char *path, char **tmp);
+static void close_new(FILE *file, const char *path, char *tmp);
+
+static void write_delta(void) {
+	long long version = -1;
+	long started = 0, now_started;
+	char tail[128], *line, *nl;
+	mpd_Status *status;
+	mpd_Stats *stats;
+	char *tmp = 0;
+	FILE *in;
+	int full;
+
+	/* Find out what has been recorded the last time */
+	in = fopen(opt_delta, "r");
+	if (in) {
+		int partial = !fseek(in, 1 - (long)sizeof tail, SEEK_END);
+		size_t len;
+		if (!partial) {
+			rewind(in);
+		}
+		len = fread(tail, 1, sizeof tail - 1, in);
+		tail[len] = 0;
+		fclose(in);
+
+		/* Skip the line we have likely started in the middle of */
+		line = partial && (nl = strchr(tail, '\n')) ? nl + 1 : tail;
+		for (; (nl = strchr(line, '\n')); line = nl + 1) {
+			if (!strncmp(line, "version: ", 9)) {
+				version = atoll(line + 9);
+			} else if (!strncmp(line, "started: ", 9)) {
+				started = atol(line + 9);
+			}
+		}
+	}
+
+	status = get_status();
+
+	mpd_sendStatsCommand(conn);
+	print_error_and_exit(3);
+	stats = mpd_getStats(conn);
+	print_error_and_exit(3);
+	mpd_finishCommand(conn);
+	now_started = (long)time(0) - (long)stats->uptime;
+	mpd_freeStats(stats);
+
+	/* Uptime has one second resolution and the clock may be adjusted,
+	 * allow for some slack when checking for restarts. */
+	full = version < 0 || status->playlist < version ||
+		started - now_started > 5 || now_started - started > 5;
+
+	out = full ? open_new(opt_delta, &tmp) : fopen(opt_delta, "a");
+	if (!out) {
+		ERR2("%s: %s", opt_delta, strerror(errno));
+		exit(1);
+	}
+
+	if (full) {
+		print_status_lines(status);
+		print_playlist();
+		print_outputs();
+		fprintf(out, "version: %lld\nstarted: %ld\n",
+		        status->playlist, now_started);
+	} else {
+		mpd_InfoEntity *entity;
+
+		fputs("delta_begin\n", out);
+		print_status_lines(status);
+		fprintf(out, "length: %i\n", status->playlistLength);
+
+		fputs("changes_begin\n", out);
+		if (status->playlist != version) {
+			mpd_sendPlChangesCommand(conn, version);
+			while ((entity = mpd_getNextInfoEntity(conn))) {
+				if (entity->type==MPD_INFO_ENTITY_TYPE_SONG) {
+					mpd_Song *song = entity->info.song;
+					fprintf(out, "%i:%s\n", song->pos, song->file);
+				}
+				mpd_freeInfoEntity(entity);
+			}
+			mpd_finishCommand(conn);
+			print_error_and_exit(3);
+		}
+		fputs("changes_end\n", out);
+
+		print_outputs();
+		fprintf(out, "version: %lld\nstarted: %ld\ndelta_end\n",
+		        status->playlist, now_started);
+	}
+
+	mpd_freeStatus(status);
+	if (full) {
+		close_new(out, opt_delta, tmp);
+	} else if (fclose(out)) {
+		ERR2("%s: %s", opt_delta, strerror(errno));
+		exit(1);
+	}
+}
+
+
+static char *xstrdup(const char *str) {
+	char *ret = strdup(str);
+	if (!ret) {
+		ERR("%s", "out of memory");
+		exit(1);
+	}
+	return ret;
+}
+
+static void compact(void) {
+	char *buffer = 0, *status = 0, *outputs = 0, **playlist = 0;
+	char *version = 0, *started = 0;
+	size_t buffer_size = 0, status_len = 0, outputs_len = 0;
+	long length = 0, capacity = 0, i;
+	int section = 0;
+	char *tmp, *str;
+	FILE *in;
+
+	in = fopen(opt_compact, "r");
+	if (!in) {
+		ERR2("%s: %s", opt_compact, strerror(errno));
+		exit(1);
+	}
+
+	/* Replay the records.  Status lines, version, started and
+	 * outputs are simply taken from the last record; playlist is
+	 * patched with each change and then truncated. */
+	/* Lines can be of any length; a file name cut in two would end up
+	 * as a bogus entry. */
+	while (getline(&buffer, &buffer_size, in) >= 0) {
+		if (!strcmp(buffer, "delta_begin\n")) {
+			section = 0;
+			status_len = 0;
+		} else if (!strcmp(buffer, "delta_end\n")) {
+			section = 0;
+		} else if (!strcmp(buffer, "playlist_begin\n")) {
+			section = 'p';
+			length = 0;
+		} else if (!strcmp(buffer, "changes_begin\n")) {
+			section = 'p';
+		} else if (!strcmp(buffer, "outputs_begin\n")) {
+			section = 'o';
+			outputs_len = 0;
+		} else if (!strcmp(buffer, "playlist_end\n") ||
+		           !strcmp(buffer, "changes_end\n") ||
+		           !strcmp(buffer, "outputs_end\n")) {
+			section = 0;
+		} else if (section == 'p' && (str = strchr(buffer, ':'))) {
+			long pos = strtol(buffer, 0, 10);
+			if (pos < 0) {
+				continue;
+			}
+			if (pos >= capacity) {
+				long c = capacity ? capacity : 1024;
+				while (c <= pos) c *= 2;
+				playlist = realloc(playlist, c * sizeof *playlist);
+				if (!playlist) {
+					ERR("%s", "out of memory");
+					exit(1);
+				}
+				memset(playlist + capacity, 0,
+				       (c - capacity) * sizeof *playlist);
+				capacity = c;
+			}
+			free(playlist[pos]);
+			playlist[pos] = xstrdup(str + 1);
+			if (pos >= length) {
+				length = pos + 1;
+			}
+		} else if (!strncmp(buffer, "version: ", 9)) {
+			free(version);
+			version = xstrdup(buffer);
+		} else if (!strncmp(buffer, "started: ", 9)) {
+			free(started);
+			started = xstrdup(buffer);
+		} else if (!strncmp(buffer, "length: ", 8)) {
+			long l = atol(buffer + 8);
+			for (i = l; i < length; ++i) {
+				free(playlist[i]);
+				playlist[i] = 0;
+			}
+			if (l < length) {
+				length = l;
+			}
+		} else {
+			/* Status or output line; append to the right buffer */
+			char **dst = section == 'o' ? &outputs : &status;
+			size_t *len = section == 'o' ? &outputs_len : &status_len;
+			size_t l = strlen(buffer);
+			tmp = realloc(*dst, *len + l + 1);
+			if (!tmp) {
+				ERR("%s", "out of memory");
+				exit(1);
+			}
+			memcpy(tmp + *len, buffer, l + 1);
+			*dst = tmp;
+			*len += l;
+		}
+	}
+	free(buffer);
+	fclose(in);
+
+	out = open_new(opt_compact, &tmp);
+
+	if (status_len) fwrite(status, 1, status_len, out);
+	fputs("playlist_begin\n", out);
+	for (i = 0; i < length; ++i) {
+		if (playlist[i]) {
+			fprintf(out, "%li:%s", i, playlist[i]);
+		}
+	}
+	fputs("playlist_end\noutputs_begin\n", out);
+	if (outputs_len) fwrite(outputs, 1, outputs_len, out);
+	fputs("outputs_end\n", out);
+	if (version) fputs(version, out);
+	if (started) fputs(started, out);
+
+	close_new(out, opt_compact, tmp);
+}
+
+
+/* Opens a temporary file next to path; close_new() moves it over path. */
+static FILE *open_new(const char *path, char **tmp) {
+	FILE *file;
+
+	*tmp = malloc(strlen(path) + 5);
+	if (!*tmp) {
+		ERR("%s", "out of memory");
+		exit(1);
+	}
+	strcat(strcpy(*tmp, path), ".new");
+
+	file = fopen(*tmp, "w");
+	if (!file) {
+		ERR2("%s: %s", *tmp, strerror(errno));
+		exit(1);
+	}
+	return file;
+}
+
+static void close_new(FILE *file, const char *path, char *tmp) {
+	if (fclose(file) || rename(tmp, path)) {
+		ERR2("%s: %s", path, strerror(errno));
+		unlink(tmp);
+		exit(1);
+	}
+	free(tmp);
+}
+
+
+
 /********** Prints error end exits if there is any **********/
 static void print_error_and_exit(int error_code) {
 	if (conn->error) {